@@ -1,304 +1,1379 @@
 #include "Huffman.h"
+#include "HuffmanDictionary.h"
+#include "HuffmanStats.h"
 
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <utility>
 #include <queue>
 #include <vector>
 #include <functional>
 #include <algorithm>
+#include <cstring>
+#include <bit>
+#include <sstream>
 #include <memory>
 
 
 using namespace ThorsAnvil::Puzzle;
 
-Huffman::Node::~Node()
+// Read a Huffman tree from the head of a file.
+// The tree is serialized via exportTree() (see below)
+// Nodes are added to the array in the order they are read (so the root is nodes[0]).
+// Non-Leaf nodes waiting for their right child are kept on a stack.
+bool Huffman::Tree::importTree(std::istream& str)
 {
-    if (left && !left->dynamic) {
-        delete left;
-    }
-    if (right && !right->dynamic) {
-        delete right;
+    std::array<std::uint16_t, maxNodes> open;
+    std::size_t                         openCount   = 0;
+    bool                                eofMark     = false;
+
+    size = 0;
+    do {
+        if (size == maxNodes) {
+            return false;
+        }
+        Node    node;
+        char    x = str.get();
+        switch (x)
+        {
+            case 'N':
+                break;
+            case 'C':
+                node.symbol = static_cast<unsigned char>(str.get());
+                break;
+            case 'Z':
+                node.symbol = 256;
+                eofMark     = true;
+                break;
+            default:
+                return false;
+        }
+        std::uint16_t   index = add(node);
+        if (index != 0) {
+            Node&   parent = nodes[open[openCount - 1]];
+            if (parent.left == 0) {
+                parent.left     = index;
+            }
+            else {
+                parent.right    = index;
+                --openCount;
+            }
+        }
+        if (x == 'N') {
+            open[openCount++] = index;
+        }
     }
-}
+    while (openCount != 0);
 
-// Build a non leaf node
-Huffman::Node::Node(std::size_t cost, Node* left, Node* right)
-    : cost(cost)
-    , dynamic(true)
-    , left(left)
-    , right(right)
-{}
+    return str && eofMark;
+}
 
-// Used to read a Huffman tree dynamically from the head of a file.
-// The tree is serialized via exportTree() (see below)
-// The user is expected to check ok and eofMark are both true after is read
-Huffman::Node::Node(std::istream& str, std::size_t pSize, std::size_t pValue, bool& ok, bool& eofMark)
-    : dynamic(true)
+// Encode a Huffman tree to a stream.
+void Huffman::Tree::exportTree(std::ostream& str) const
 {
-    char x = '-';
-    x = str.get();
-    switch (x)
-    {
-        case 'N':
-            left    = new Node(str, pSize + 1, (pValue << 1) | 0x0, ok, eofMark);
-            right   = new Node(str, pSize + 1, (pValue << 1) | 0x1, ok, eofMark);
-            break;
-        case 'C':
-            letter  = str.get();
-            size    = pSize;
-            value   = pValue;
-            break;
-        case 'Z':
-            eof     = true;
-            eofMark = true;
-            break;
-        default:
-            ok      = false;
+    std::array<std::uint16_t, maxNodes> stack;
+    std::size_t                         top = 0;
+
+    stack[top++] = 0;
+    while (top != 0) {
+        Node const& node = nodes[stack[--top]];
+        if (node.isLeaf()) {
+            if (node.symbol == 256) {
+                str << "Z";
+            }
+            else {
+                str << "C" << static_cast<unsigned char>(node.symbol);
+            }
+        }
+        else {
+            str << "N";
+            stack[top++] = node.right;
+            stack[top++] = node.left;
+        }
     }
 }
 
-// Encode a Huffman tree to a stream.
-void Huffman::Node::exportTree(std::ostream& str)
+// Calculate the representation of each symbol from its position in the tree.
+// Going left adds a 0 bit going right adds a 1 bit.
+void Huffman::Tree::assignCodes(std::array<Code, symbolCount>& codes) const
 {
-    if (left == nullptr && right == nullptr) {
-        if (eof) {
-            str << "Z";
+    struct Position
+    {
+        std::uint16_t   node;
+        Code            code;
+    };
+    std::array<Position, maxNodes>  stack;
+    std::size_t                     top = 0;
+
+    codes.fill(Code{});
+    stack[top++] = {0, {0, 0}};
+    while (top != 0) {
+        Position    position    = stack[--top];
+        Node const& node        = nodes[position.node];
+        if (node.isLeaf()) {
+            codes[node.symbol] = position.code;
         }
         else {
-            str << "C" << letter;
+            std::uint64_t   value   = position.code.value << 1;
+            std::uint64_t   length  = position.code.length + 1;
+            stack[top++] = {node.right, {value | 0x1, length}};
+            stack[top++] = {node.left,  {value | 0x0, length}};
         }
     }
-    else {
-        str << "N";
-        left->exportTree(str);
-        right->exportTree(str);
-    }
 }
 
-// Once a Huffman tree is built from scratch.
-// Call this function to calculate the representation of each letter.
-// Also calculate the size of the output file that will be generated.
-std::size_t Huffman::Node::setName()
+// Canonical Huffman codes.
+// Codes of the same length are consecutive values (in symbol order) and each length
+// starts where the previous length finished (shifted left by one). This means the
+// codes can be rebuilt from the lengths alone.
+// Note: All lengths must be <= maxCodeLength.
+Huffman::CodeValues Huffman::canonicalValues(CodeLengths const& lengths)
 {
-    DataSize size = setName(0, 0);
-
-    // Size of the Huffman tree in bytes.
-    std::size_t treeSize    = size.first;
+    std::array<std::uint64_t, maxCodeLength + 1>    lengthCount{};
+    for (auto length: lengths) {
+        ++lengthCount[length];
+    }
+    lengthCount[0] = 0;
 
-    // size.second is the number of bits.
-    // So Calculate the number of `std::size_t` objects needs to be written to the output stream.
-    std::size_t streamCount = size.second / (sizeof(std::size_t) * 8);
-    std::size_t streamRem   = size.second % (sizeof(std::size_t) * 8);
-    std::size_t streamSize  = streamCount * sizeof(std::size_t) + (streamRem == 0 ? 0 : sizeof(std::size_t));
+    std::array<std::uint64_t, maxCodeLength + 1>    nextCode{};
+    std::uint64_t                                   code = 0;
+    for (std::size_t length = 1; length <= maxCodeLength; ++length) {
+        code = (code + lengthCount[length - 1]) << 1;
+        nextCode[length] = code;
+    }
 
-    // return the number of bytes that will be sent to the stream
-    return treeSize + streamSize;
+    CodeValues  values{};
+    for (std::size_t symbol = 0; symbol < symbolCount; ++symbol) {
+        if (lengths[symbol] != 0) {
+            values[symbol] = nextCode[lengths[symbol]]++;
+        }
+    }
+    return values;
 }
 
-// Sets the value of each lead node and how it is represented.
-// Return data about the amount of data that will written to the output.
-//  first:  Number of bytes representing the Huffman tree when encoding.
-//  second: Number of bits to represent the data of the file.
-Huffman::Node::DataSize Huffman::Node::setName(std::size_t pSize, std::size_t pValue)
+// Add the bytes in input to the histogram.
+// Incrementing a single table stalls when the same byte repeats (each increment
+// has to wait for the previous store to the same counter). So we spread the bytes
+// over four tables of compact counters, process 16 bytes per iteration and merge
+// the tables at the end.
+// The counters are 32 bits so the input is processed in chunks small enough that they can not overflow.
+void Huffman::histogram(std::span<char const> input, Histogram& counts)
 {
-    if (left == nullptr && right == nullptr) {
-        size = pSize;
-        value = pValue;
-        if (eof) {
-            return {1, pSize * cost};
+    static constexpr std::size_t tableCount = 4;
+    static constexpr std::size_t chunkSize  = std::size_t{1} << 30;
+
+    while (!input.empty()) {
+        std::span<char const>   chunk   = input.first(std::min(chunkSize, input.size()));
+        input = input.subspan(chunk.size());
+
+        std::uint32_t           tables[tableCount][256] = {};
+        char const*             data    = chunk.data();
+        char const*             end     = data + chunk.size();
+
+        for (; end - data >= 16; data += 16) {
+            std::uint64_t   first;
+            std::uint64_t   second;
+            std::memcpy(&first,  data,     sizeof(first));
+            std::memcpy(&second, data + 8, sizeof(second));
+
+            ++tables[0][(first  >>  0) & 0xFF];
+            ++tables[1][(first  >>  8) & 0xFF];
+            ++tables[2][(first  >> 16) & 0xFF];
+            ++tables[3][(first  >> 24) & 0xFF];
+            ++tables[0][(first  >> 32) & 0xFF];
+            ++tables[1][(first  >> 40) & 0xFF];
+            ++tables[2][(first  >> 48) & 0xFF];
+            ++tables[3][(first  >> 56) & 0xFF];
+            ++tables[0][(second >>  0) & 0xFF];
+            ++tables[1][(second >>  8) & 0xFF];
+            ++tables[2][(second >> 16) & 0xFF];
+            ++tables[3][(second >> 24) & 0xFF];
+            ++tables[0][(second >> 32) & 0xFF];
+            ++tables[1][(second >> 40) & 0xFF];
+            ++tables[2][(second >> 48) & 0xFF];
+            ++tables[3][(second >> 56) & 0xFF];
         }
-        else {
-            return {2, pSize * cost};
+        for (; data != end; ++data) {
+            ++tables[0][static_cast<unsigned char>(*data)];
         }
-    }
-    else {
-        DataSize l = left->setName( pSize + 1, (pValue << 1) | 0x0);
-        DataSize r = right->setName(pSize + 1, (pValue << 1) | 0x1);
 
-        return {l.first + r.first + 1, l.second + r.second};
+        for (std::size_t loop = 0; loop < 256; ++loop) {
+            counts[loop] += std::uint64_t{tables[0][loop]} + tables[1][loop] + tables[2][loop] + tables[3][loop];
+        }
     }
 }
 
-HuffmanEncoder::HuffmanEncoder()
+HuffmanEncoder::HuffmanEncoder(bool canonical, std::size_t codeLengthLimit)
+    : canonical(canonical)
+    , codeLengthLimit(std::clamp(codeLengthLimit, minCodeLength, maxCodeLength))
 {
-    for (int loop = 0; loop < 256; ++loop) {
-        count[loop].letter = static_cast<unsigned char>(loop);
-    }
-    count[256].eof = true;
-    count[256].cost = 1;
+    costs.fill(0);
+    costs[256] = 1;
 }
 
 bool HuffmanEncoder::buildTree(std::istream& input)
 {
     // Count the number of each character in a file.
-    std::size_t charCount = 0;
-    for (unsigned char c = input.get(); input; c = input.get()) {
-        ++count[c].cost;
-        ++charCount;
+    // The file is read in large chunks so the histogram kernel can be used.
+    static constexpr std::size_t bufferSize = 64 * 1024;
+
+    std::vector<char>   buffer(bufferSize);
+    Histogram           counts{};
+    std::size_t         charCount = 0;
+    {
+        HuffmanStats::Timer timer(stats, HuffmanStats::Histogram);
+        while (input.read(buffer.data(), bufferSize) || input.gcount() != 0) {
+            histogram({buffer.data(), static_cast<std::size_t>(input.gcount())}, counts);
+            charCount += input.gcount();
+        }
+        timer.setBytes(charCount);
     }
     if (charCount == 0) {
         std::cerr << "File is Empty!\n";
         return false;
     }
 
+    std::size_t cost = buildTree(counts);
+    if (cost > charCount) {
+        std::cerr << "Compesssion does not make it smaller\n";
+        return false;
+    }
+    return true;
+}
+
+// Count the characters in a block of memory and build the Huffman tree.
+// Returns the number of bytes exportTree() and encode() will generate (0 if the block is empty).
+std::size_t HuffmanEncoder::buildTree(std::span<char const> input)
+{
+    Histogram   counts{};
+    {
+        HuffmanStats::Timer timer(stats, HuffmanStats::Histogram, input.size());
+        histogram(input, counts);
+    }
+    return buildTree(counts);
+}
+
+// Build the Huffman tree from a histogram of the input.
+// Returns the number of bytes exportTree() and encode() will generate (0 if the histogram is empty).
+std::size_t HuffmanEncoder::buildTree(Histogram const& histogram)
+{
+    return buildTree(histogram, canonical);
+}
+
+std::size_t HuffmanEncoder::buildTree(Histogram const& histogram, bool canonicalCodes)
+{
+    dictionaryId.reset();
+
+    std::uint64_t   total = 0;
+    for (std::size_t loop = 0; loop < histogram.size(); ++loop) {
+        costs[loop] = histogram[loop];
+        total += histogram[loop];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    HuffmanStats::Timer timer(stats, HuffmanStats::BuildTree, total);
+    return makeTree(canonicalCodes);
+}
+
+// Build the Huffman tree from the character counts.
+// Returns the number of bytes that will be sent to the stream.
+std::size_t HuffmanEncoder::makeTree(bool canonicalCodes)
+{
     // Now build the Huffman tree.
-    // Here we are dynamically allocating nodes without protection.
-    // So we need to build it inside a try/catch block so if there
-    // is an issue it will be correctly tidied up.
-    std::priority_queue<Node*, std::vector<Node*>, std::function<bool(Node*, Node*)>>   p1{[](Node* l, Node* r){return l->cost > r->cost;}};
-    try
+    // The queue (a heap in a fixed array) holds the cost and index of each node that does not have a parent yet.
+    // The root is the last node built but it must be nodes[0] so that slot is reserved.
+    using Entry = std::pair<std::uint64_t, std::uint16_t>;
+    auto greater = [](Entry const& l, Entry const& r){return l.first > r.first;};
+    std::array<Entry, symbolCount>  queue;
+    std::size_t                     queueSize = 0;
+    auto push = [&](Entry const& entry)
     {
-        for (int loop = 0; loop < 257; ++loop) {
-            if (count[loop].cost != 0) {
-                p1.emplace(&count[loop]);
-            }
+        queue[queueSize++] = entry;
+        std::push_heap(std::begin(queue), std::begin(queue) + queueSize, greater);
+    };
+    auto pop = [&]()
+    {
+        std::pop_heap(std::begin(queue), std::begin(queue) + queueSize, greater);
+        return queue[--queueSize];
+    };
+
+    tree.size = 1;
+    for (std::uint16_t symbol = 0; symbol < symbolCount; ++symbol) {
+        if (costs[symbol] != 0) {
+            push({costs[symbol], tree.add({0, 0, symbol})});
         }
-        while (p1.size() > 1) {
-            Node*   a = p1.top();p1.pop();
-            Node*   b = p1.top();p1.pop();
+    }
+    // Note: There are always at least two leaf nodes (the EOF marker and one letter).
+    while (queueSize > 2) {
+        Entry   a = pop();
+        Entry   b = pop();
 
-            Node*   r = new Node{a->cost + b->cost, a, b};
-            p1.emplace(r);
+        push({a.first + b.first, tree.add({a.second, b.second, 0})});
+    }
+    Entry   a = pop();
+    Entry   b = pop();
+    tree.nodes[0] = {a.second, b.second, 0};
+
+    // Calculate the representation of all the leaf nodes.
+    tree.assignCodes(codes);
+
+    // Calculate the size of the output file that will be generated.
+    //  Tree:   One byte per node plus the value of each letter.
+    //  Stream: Whole std::uint64_t values.
+    std::size_t     treeSize    = tree.size;
+    std::uint64_t   bits        = 0;
+    for (std::size_t symbol = 0; symbol < symbolCount; ++symbol) {
+        if (costs[symbol] != 0) {
+            treeSize    += (symbol == 256 ? 0 : 1);
+            bits        += codes[symbol].length * costs[symbol];
         }
     }
-    catch(...)
-    {
-        // There was an exception we need to handle cleanup.
-        while (p1.size()) {
-            Node* n = p1.top();
-            p1.pop();
-            if (n && n->dynamic) {
-                delete n;
+    std::size_t     cost        = treeSize + (bits + 63) / 64 * sizeof(std::uint64_t);
+    if (canonicalCodes) {
+        cost = makeCanonical();
+    }
+
+    longestCode = 0;
+    for (auto const& code: codes) {
+        longestCode = std::max(longestCode, code.length);
+    }
+    return cost;
+}
+
+// Limit the code lengths to codeLengthLimit and assign canonical codes.
+// Returns the number of bytes that will be sent to the stream.
+std::size_t HuffmanEncoder::makeCanonical()
+{
+    // The number of codes of each length.
+    // Note: A tree with symbolCount leaves is at most (symbolCount - 1) deep.
+    std::array<std::size_t, symbolCount>    lengthCount{};
+    std::size_t                             symbolsUsed = 0;
+    std::size_t                             maxDepth    = 0;
+    for (std::size_t symbol = 0; symbol < symbolCount; ++symbol) {
+        if (costs[symbol] != 0) {
+            ++lengthCount[codes[symbol].length];
+            ++symbolsUsed;
+            maxDepth = std::max(maxDepth, codes[symbol].length);
+        }
+    }
+
+    // The symbols in use ordered by the length of the code the tree gave them.
+    // The most frequent symbols have the shortest codes.
+    // A counting sort keeps symbols of the same length in symbol order.
+    std::array<std::uint16_t, symbolCount>  symbols;
+    std::array<std::size_t, symbolCount>    position{};
+    for (std::size_t length = 1; length < symbolCount; ++length) {
+        position[length] = position[length - 1] + lengthCount[length - 1];
+    }
+    for (std::uint16_t symbol = 0; symbol < symbolCount; ++symbol) {
+        if (costs[symbol] != 0) {
+            symbols[position[codes[symbol].length]++] = symbol;
+        }
+    }
+
+    // Limit the length of the codes (see JPEG ITU T.81 Annex K.3).
+    // Leaves at the deepest level come in pairs. Take a pair: one of them
+    // replaces its parent one level up; the other becomes the sibling of a
+    // shorter leaf (which moves down one level to make room for it).
+    for (std::size_t length = maxDepth; length > codeLengthLimit; --length) {
+        while (lengthCount[length] > 0) {
+            std::size_t shorter = length - 2;
+            while (lengthCount[shorter] == 0) {
+                --shorter;
             }
+            lengthCount[length]         -= 2;
+            lengthCount[length - 1]     += 1;
+            lengthCount[shorter + 1]    += 2;
+            lengthCount[shorter]        -= 1;
         }
-        // Re-throw the exception
-        throw;
     }
 
-    // We now have the tree correctly rooted.
-    root.reset(p1.top());
+    // Hand out the lengths (shortest first) in the original order.
+    CodeLengths     lengths{};
+    std::size_t     next = 0;
+    for (std::size_t length = 1; length < lengthCount.size(); ++length) {
+        for (std::size_t loop = 0; loop < lengthCount[length]; ++loop) {
+            lengths[symbols[next++]] = length;
+        }
+    }
 
-    // Calculate the representation of all the leaf nodes.
-    std::size_t cost = root->setName();
-    if (cost > charCount) {
-        std::cerr << "Compesssion does not make it smaller\n";
-        return false;
+    // Replace the codes from the tree with the canonical codes.
+    CodeValues      values = canonicalValues(lengths);
+    std::size_t     bits   = 0;
+    for (auto symbol: std::span(symbols).first(symbolsUsed)) {
+        codes[symbol]   = {values[symbol], lengths[symbol]};
+        bits += codes[symbol].length * costs[symbol];
     }
-    return true;
+
+    // Header:  Marker plus the table of code lengths.
+    // Stream:  Whole std::uint64_t values.
+    std::size_t     headerSize = 1 + lengths.size();
+    std::size_t     streamSize = (bits + 63) / 64 * sizeof(std::uint64_t);
+    return headerSize + streamSize;
+}
+
+// Use the code of a dictionary.
+// The code lengths are turned into canonical codes (like makeCanonical() does) so the
+// encoder is ready to go without looking at the input.
+void HuffmanEncoder::useDictionary(HuffmanDictionary const& value)
+{
+    CodeLengths const&  lengths = value.codeLengths();
+    CodeValues          values  = canonicalValues(lengths);
+    longestCode = 0;
+    for (std::size_t symbol = 0; symbol < symbolCount; ++symbol) {
+        codes[symbol]   = {values[symbol], lengths[symbol]};
+        longestCode     = std::max(longestCode, codes[symbol].length);
+    }
+    dictionaryId = value.getId();
 }
 
 // Export the Huffman tree to the file.
+// Canonical codes are exported as 'L' followed by the length of the code for each symbol.
+// A dictionary is exported as 'T' followed by its id.
 void HuffmanEncoder::exportTree(std::ostream& out)
 {
-    root->exportTree(out);
+    HuffmanStats::Timer timer(stats, HuffmanStats::ExportTree);
+    if (dictionaryId) {
+        std::uint32_t   id = *dictionaryId;
+        out << HuffmanDictionary::marker;
+        out.write(reinterpret_cast<char const*>(&id), sizeof(id));
+        if (stats) {
+            stats->addHeader(HuffmanDictionary::headerSize);
+        }
+        return;
+    }
+    if (canonical) {
+        CodeLengths     lengths = codeLengths();
+        out << "L";
+        out.write(reinterpret_cast<char const*>(lengths.data()), lengths.size());
+        if (stats) {
+            stats->addHeader(1 + lengths.size());
+        }
+        return;
+    }
+    tree.exportTree(out);
+    if (stats) {
+        // One byte per node plus the value of each letter.
+        std::size_t     letters = 0;
+        for (std::size_t loop = 0; loop < tree.size; ++loop) {
+            letters += tree.nodes[loop].isLeaf() && tree.nodes[loop].symbol != 256;
+        }
+        stats->addHeader(tree.size + letters);
+    }
+}
+
+// The length of the code for each symbol.
+Huffman::CodeLengths HuffmanEncoder::codeLengths() const
+{
+    CodeLengths     lengths;
+    for (std::size_t symbol = 0; symbol < symbolCount; ++symbol) {
+        lengths[symbol] = codes[symbol].length;
+    }
+    return lengths;
+}
+
+namespace ThorsAnvil::Puzzle
+{
+    // Packs codes into the encoded stream.
+    // The stream is a sequence of std::uint64_t values each holding 64 bits (most significant bit first).
+    // Bits are collected in 'current' and moved to the output buffer 32 bits at a time. The halves
+    // are stored so that each pair forms a std::uint64_t value in native byte order.
+    // check() is branch free: it always stores the top 32 bits but only moves on when they are full.
+    // The output is either a stream or a block of memory (the caller makes sure it is large enough).
+    class BitWriter
+    {
+        static constexpr std::size_t bufferSize = 16 * 1024;
+        static constexpr std::size_t highHalf   = std::endian::native == std::endian::little ? 1 : 0;
+
+        std::ostream*                               out         = nullptr;
+        std::byte*                                  dst         = nullptr;
+        std::array<std::uint32_t, bufferSize + 2>   buffer;
+        std::size_t                                 pos         = 0;
+        std::uint64_t                               current     = 0;
+        std::size_t                                 used        = 0;
+
+        // Write all complete std::uint64_t values.
+        // An incomplete value (one half) is moved to the front of the buffer.
+        void flush()
+        {
+            std::size_t     whole = pos & ~std::size_t{1};
+            std::size_t     bytes = whole * sizeof(std::uint32_t);
+            if (out) {
+                out->write(reinterpret_cast<char const*>(buffer.data()), bytes);
+            }
+            else {
+                std::memcpy(dst, buffer.data(), bytes);
+                dst += bytes;
+            }
+            buffer[0] = buffer[whole];
+            buffer[1] = buffer[whole + 1];
+            pos -= whole;
+        }
+
+        public:
+            BitWriter(std::ostream& out)
+                : out(&out)
+            {}
+            BitWriter(std::span<std::byte> out)
+                : dst(out.data())
+            {}
+
+            // The end of the data written to a block of memory (once finish() has been called).
+            std::byte* position() const
+            {
+                return dst;
+            }
+
+            // Add a code of at most 32 bits.
+            // check() must be called before the total added since the last check exceeds 32 bits.
+            void add(Huffman::Code const& code)
+            {
+                current = (current << code.length) | code.value;
+                used    += code.length;
+            }
+
+            // Move the top 32 bits to the output if they are full.
+            void check()
+            {
+                std::size_t full = used >> 5;
+                used -= full * 32;
+                buffer[pos ^ highHalf] = static_cast<std::uint32_t>(current >> used);
+                pos += full;
+                if (pos >= bufferSize) {
+                    flush();
+                }
+            }
+
+            // Add a code of any length (up to 64 bits) 32 bits at a time.
+            void addLong(Huffman::Code const& code)
+            {
+                std::uint64_t   length = code.length;
+                while (length > 32) {
+                    length -= 32;
+                    add({(code.value >> length) & 0xFFFFFFFF, 32});
+                    check();
+                }
+                add({code.value & ((std::uint64_t{1} << length) - 1), length});
+                check();
+            }
+
+            // Pad the stream with zero bits to complete the last std::uint64_t value and write it.
+            void finish()
+            {
+                if (used != 0) {
+                    buffer[pos ^ highHalf] = static_cast<std::uint32_t>(current << (32 - used));
+                    ++pos;
+                    used = 0;
+                }
+                if (pos & 1) {
+                    buffer[pos ^ highHalf] = 0;
+                    ++pos;
+                }
+                flush();
+            }
+    };
 }
 
 // using the Huffman tree encode the input file to the output file.
 void HuffmanEncoder::encode(std::istream& in, std::ostream& out)
 {
-    std::uint64_t const   maxSize     = sizeof(std::uint64_t) * 8;
-    std::uint64_t         currentLen  = 0;
-    std::uint64_t         currentVal  = 0;
+    static constexpr std::size_t bufferSize = 64 * 1024;
 
-    // Add each of the characters one at a time.
-    for (unsigned char c = in.get(); in; c = in.get()) {
-        add(out, count, maxSize, currentLen, currentVal, c);
+    HuffmanStats::Timer timer(stats, HuffmanStats::Encode);
+    BitWriter           writer(out);
+    std::vector<char>   buffer(bufferSize);
+    std::size_t         charCount = 0;
+    while (in.read(buffer.data(), bufferSize) || in.gcount() != 0) {
+        encode({buffer.data(), static_cast<std::size_t>(in.gcount())}, writer);
+        charCount += in.gcount();
     }
-    // Add the EOF marker.
-    add(out, count, maxSize, currentLen, currentVal, 256);
+    writer.addLong(codes[256]);
+    writer.finish();
+    timer.setBytes(charCount);
+    if (stats && !dictionaryId) {
+        stats->addCode(costs, codes);
+    }
+}
 
-    // If there is data left in the currentValue
-    // Then push that to the stream.
-    if (currentLen != 0) {
-        std::uint64_t shift = maxSize - currentLen;
-        currentVal = currentVal << shift;
-        out.write(reinterpret_cast<char*>(&currentVal), sizeof(currentVal));
+void HuffmanEncoder::encode(std::span<char const> in, std::ostream& out)
+{
+    HuffmanStats::Timer timer(stats, HuffmanStats::Encode, in.size());
+    BitWriter           writer(out);
+    encode(in, writer);
+    writer.addLong(codes[256]);
+    writer.finish();
+    if (stats && !dictionaryId) {
+        stats->addCode(costs, codes);
     }
 }
 
-// Encode a sing character 'c'
-// If this fills the 'currentVal' object then write to the file.
-void HuffmanEncoder::add(std::ostream& out, Node* count, std::uint64_t const& maxSize, std::uint64_t& currentLen, std::uint64_t& currentVal, int c)
+// Compress a block of memory into a caller provided buffer.
+// buildTree() tells us exactly how much output there will be so we can check it fits before we start.
+std::size_t HuffmanEncoder::compress(std::span<std::byte const> in, std::span<std::byte> out)
 {
-    // Representation of the char 'c'
-    Node& val = count[c];
+    std::span<char const>   data(reinterpret_cast<char const*>(in.data()), in.size());
+    if (dictionaryId) {
+        return compressWithDictionary(data, out);
+    }
+    Histogram               counts{};
+    {
+        HuffmanStats::Timer timer(stats, HuffmanStats::Histogram, data.size());
+        histogram(data, counts);
+    }
+
+    std::size_t             size = buildTree(counts, true);
+    if (size == 0 || size > out.size()) {
+        return 0;
+    }
 
-    // The value that needs to be encoded.
-    // This may fit into multiple values
-    std::uint64_t writeLen = val.size;
-    std::uint64_t writeVal = val.value;
+    CodeLengths             lengths = codeLengths();
+    out[0] = std::byte{'L'};
+    std::memcpy(out.data() + 1, lengths.data(), lengths.size());
 
-    while (writeLen != 0) {
-        // How much can we write into the current value.
-        std::uint64_t outLen = std::min(writeLen, (maxSize - currentLen));
+    HuffmanStats::Timer     timer(stats, HuffmanStats::Encode, data.size());
+    BitWriter               writer(out.subspan(1 + lengths.size()));
+    encode(data, writer);
+    writer.addLong(codes[256]);
+    writer.finish();
+    if (stats) {
+        stats->addHeader(1 + lengths.size());
+        stats->addCode(costs, codes);
+    }
+    return size;
+}
 
-        // Add as many bits as we can from encoded 'c' into this value.
-        currentVal = (currentVal << outLen) | (writeVal >> (writeLen - outLen));
-        currentLen += outLen;
+// With a dictionary the output size is only known once the data is encoded.
+std::size_t HuffmanEncoder::compressWithDictionary(std::span<char const> data, std::span<std::byte> out)
+{
+    if (data.empty() || maxCompressedSize(data.size()) > out.size()) {
+        return 0;
+    }
 
-        // Remove what we have encode
-        std::uint64_t mask = (std::uint64_t{1} << (writeLen - outLen)) - 1;
-        writeVal = writeVal & mask;
-        writeLen -= outLen;
+    std::uint32_t           id = *dictionaryId;
+    out[0] = std::byte{HuffmanDictionary::marker};
+    std::memcpy(out.data() + 1, &id, sizeof(id));
 
-        // If we have filled up the current value write to the output file.
-        if (currentLen == maxSize) {
-            out.write(reinterpret_cast<char*>(&currentVal), sizeof(currentVal));
-            currentVal = 0;
-            currentLen = 0;
+    HuffmanStats::Timer     timer(stats, HuffmanStats::Encode, data.size());
+    BitWriter               writer(out.subspan(HuffmanDictionary::headerSize));
+    encode(data, writer);
+    writer.addLong(codes[256]);
+    writer.finish();
+    if (stats) {
+        stats->addHeader(HuffmanDictionary::headerSize);
+    }
+    return writer.position() - out.data();
+}
+
+// The largest output compress() can generate for an input of 'size' bytes.
+// The code length table plus every symbol (and the EOF marker) using the longest code.
+// With a dictionary it is the dictionary header plus every symbol using the longest code in the dictionary.
+std::size_t HuffmanEncoder::maxCompressedSize(std::size_t size) const
+{
+    std::size_t header  = dictionaryId ? HuffmanDictionary::headerSize : 1 + symbolCount;
+    std::size_t maxBits = (size + 1) * (dictionaryId ? longestCode : codeLengthLimit);
+    return header + (maxBits + 63) / 64 * sizeof(std::uint64_t);
+}
+
+// Encode the input as streamCount independent bitstreams.
+// Each stream is built separately so its size is known before it is written.
+void HuffmanEncoder::encodeStreams(std::span<char const> in, std::ostream& out)
+{
+    HuffmanStats::Timer                         timer(stats, HuffmanStats::Encode, in.size());
+    std::size_t                                 segment = segmentSize(in.size());
+    std::array<std::ostringstream, streamCount> streams;
+    for (auto& stream: streams) {
+        std::span<char const>   data = in.first(std::min(segment, in.size()));
+        in = in.subspan(data.size());
+
+        BitWriter               writer(stream);
+        encode(data, writer);
+        writer.addLong(codes[256]);
+        writer.finish();
+    }
+    if (stats) {
+        // Each stream has its own EOF marker.
+        std::array<std::uint64_t, symbolCount>  counts = costs;
+        counts[256] = streamCount;
+        stats->addCode(counts, codes);
+    }
+
+    for (std::size_t loop = 0; loop < streamCount - 1; ++loop) {
+        std::uint64_t   size = streams[loop].view().size();
+        out.write(reinterpret_cast<char const*>(&size), sizeof(size));
+    }
+    for (auto const& stream: streams) {
+        out.write(stream.view().data(), stream.view().size());
+    }
+}
+
+// Encode a block of characters.
+// When the codes are short enough two codes are added for each check.
+void HuffmanEncoder::encode(std::span<char const> in, BitWriter& writer)
+{
+    unsigned char const*    data    = reinterpret_cast<unsigned char const*>(in.data());
+    unsigned char const*    end     = data + in.size();
+
+    if (longestCode <= 16) {
+        for (; end - data >= 2; data += 2) {
+            writer.add(codes[data[0]]);
+            writer.add(codes[data[1]]);
+            writer.check();
         }
     }
+    if (longestCode <= 32) {
+        for (; data != end; ++data) {
+            writer.add(codes[*data]);
+            writer.check();
+        }
+    }
+    for (; data != end; ++data) {
+        writer.addLong(codes[*data]);
+    }
 }
 
 bool HuffmanDecoder::buildTree(std::istream& input)
 {
-    bool                    ok      = true;
-    bool                    eofMark = false;
-    std::unique_ptr<Node>   result  = std::make_unique<Node>(input, 0, 0, ok, eofMark);
-    if (!ok || !eofMark) {
+    if (input.peek() == 'L') {
+        input.get();
+        return buildCanonicalTree(input);
+    }
+    if (input.peek() == HuffmanDictionary::marker) {
+        std::uint32_t   id;
+        input.get();
+        return input.read(reinterpret_cast<char*>(&id), sizeof(id)) && useDictionary(id);
+    }
+
+    HuffmanStats::Timer timer(stats, HuffmanStats::BuildTree);
+    dictionaryId.reset();
+    if (!tree.importTree(input)) {
         return false;
     }
-    root = std::move(result);
+    buildTable();
     return true;
 }
 
+// Read a table of code lengths and build the tree of canonical codes.
+bool HuffmanDecoder::buildCanonicalTree(std::istream& input)
+{
+    CodeLengths     lengths;
+    if (!input.read(reinterpret_cast<char*>(lengths.data()), lengths.size())) {
+        return false;
+    }
+    return buildTree(lengths);
+}
+
+// Use the code of a registered dictionary.
+bool HuffmanDecoder::useDictionary(std::uint32_t id)
+{
+    HuffmanDictionary const*    value = HuffmanDictionary::find(id);
+    if (!value) {
+        return false;
+    }
+    // A dictionary registered again with the same id can have a different code.
+    if (dictionaryId == id && dictionaryLengths == value->codeLengths()) {
+        return true;
+    }
+    if (!buildTree(value->codeLengths())) {
+        return false;
+    }
+    dictionaryId        = id;
+    dictionaryLengths   = value->codeLengths();
+    return true;
+}
+
+// Build the tree of canonical codes from a table of code lengths.
+bool HuffmanDecoder::buildTree(CodeLengths const& lengths)
+{
+    HuffmanStats::Timer timer(stats, HuffmanStats::BuildTree);
+    dictionaryId.reset();
+
+    // The lengths must describe a complete code (every node in the tree has two children)
+    // that includes the EOF marker.
+    std::uint64_t   kraft = 0;
+    for (auto length: lengths) {
+        if (length > maxCodeLength) {
+            return false;
+        }
+        if (length != 0) {
+            kraft += std::uint64_t{1} << (maxCodeLength - length);
+        }
+    }
+    if (lengths[256] == 0 || kraft != (std::uint64_t{1} << maxCodeLength)) {
+        return false;
+    }
+
+    // Add each code to the tree one bit at a time.
+    // A complete code has exactly (2 * codes - 1) nodes so the tree can not overflow.
+    CodeValues      values = canonicalValues(lengths);
+    tree.size = 0;
+    tree.add({});
+    for (std::uint16_t symbol = 0; symbol < symbolCount; ++symbol) {
+        if (lengths[symbol] == 0) {
+            continue;
+        }
+        std::uint16_t   current = 0;
+        for (std::size_t bit = lengths[symbol]; bit != 0; --bit) {
+            bool            branch  = (values[symbol] >> (bit - 1)) & 0x1;
+            std::uint16_t   next    = branch ? tree.nodes[current].right : tree.nodes[current].left;
+            if (next == 0) {
+                next = tree.add({});
+                (branch ? tree.nodes[current].right : tree.nodes[current].left) = next;
+            }
+            current = next;
+        }
+        tree.nodes[current].symbol = symbol;
+    }
+    buildTable();
+    return true;
+}
+
+// Build the decode table from the Huffman tree.
+// The longest code picks the decode kernel.
+//
+// First each leaf that fits in the table fills the range of entries that start with its code.
+// This gives the first letter (and its length) of every value of the next 'tableBits' bits.
+// Then each entry is made by looking up the first letter of the bits that follow the
+// letters already decoded (as long as they are complete) up to maxLetters.
+// Codes that are longer than the table record the node reached after 'tableBits' bits
+// so decode() can finish them bit by bit.
+void HuffmanDecoder::buildTable()
+{
+    struct First
+    {
+        std::uint16_t   value   = 0;        // The symbol (or the node reached for a longer code).
+        std::uint8_t    length  = 0;        // The length of the code (zero for a longer code).
+    };
+
+    std::array<std::uint16_t, maxNodes> depth;
+    std::array<std::uint32_t, maxNodes> code;
+    std::size_t                         longest = 0;
+    depth[0]    = 0;
+    code[0]     = 0;
+    for (std::size_t loop = 0; loop < tree.size; ++loop) {
+        Node const&     node = tree.nodes[loop];
+        if (node.isLeaf()) {
+            longest = std::max<std::size_t>(longest, depth[loop]);
+            continue;
+        }
+        // Children are always added to the tree after their parent.
+        depth[node.left]    = depth[loop] + 1;
+        depth[node.right]   = depth[loop] + 1;
+        code[node.left]     = depth[loop] < tableBits ? (code[loop] << 1)     : 0;
+        code[node.right]    = depth[loop] < tableBits ? (code[loop] << 1) | 1 : 0;
+    }
+    kernel  = longest <= tableBits  ? Kernel::Short
+            : longest <= 15         ? Kernel::Medium
+            :                         Kernel::Long;
+
+    table.assign(tableSize, TableEntry{});
+
+    if (tree.nodes[0].isLeaf()) {
+        // Degenerate tree (only an EOF marker): there is nothing to decode.
+        for (auto& entry: table) {
+            entry.eof = true;
+        }
+        return;
+    }
+
+    std::array<First, tableSize>    first;
+    for (std::size_t loop = 1; loop < tree.size; ++loop) {
+        Node const&     node = tree.nodes[loop];
+        if (node.isLeaf() && depth[loop] <= tableBits) {
+            std::size_t     shift = tableBits - depth[loop];
+            std::fill_n(&first[code[loop] << shift], std::size_t{1} << shift, First{node.symbol, static_cast<std::uint8_t>(depth[loop])});
+        }
+        else if (!node.isLeaf() && depth[loop] == tableBits) {
+            first[code[loop]] = First{static_cast<std::uint16_t>(loop), 0};
+        }
+    }
+
+    std::size_t     mask    = tableSize - 1;
+    for (std::size_t index = 0; index < tableSize; ++index) {
+        TableEntry&     entry   = table[index];
+        if (first[index].length == 0) {
+            // The code is longer than the table.
+            entry.bits = tableBits;
+            entry.node = first[index].value;
+            continue;
+        }
+        // Only the bits of complete letters are consumed.
+        for (std::size_t used = 0; entry.count < maxLetters;) {
+            First const&    letter = first[(index << used) & mask];
+            if (letter.length == 0 || letter.length > tableBits - used) {
+                break;
+            }
+            used        += letter.length;
+            entry.bits  = used;
+            if (letter.value == 256) {
+                entry.eof = true;
+                break;
+            }
+            entry.letters[entry.count++] = static_cast<unsigned char>(letter.value);
+        }
+    }
+}
+
+namespace ThorsAnvil::Puzzle
+{
+    // Reads the encoded stream as a sequence of bits.
+    // The encoder writes the bits into std::uint64_t values (most significant bit first)
+    // so we keep the current value and the next value so we can always look at
+    // the next 64 bits of the stream.
+    // The encoded data is either a block of memory or is read from a stream in large chunks.
+    class BitReader
+    {
+        static constexpr std::size_t maxSize    = sizeof(std::uint64_t) * 8;
+        static constexpr std::size_t bufferSize = 64 * 1024;
+
+        std::istream*       in          = nullptr;
+        std::vector<char>   buffer;
+        char const*         pos         = nullptr;
+        char const*         end         = nullptr;
+        std::uint64_t       current     = 0;
+        std::uint64_t       next        = 0;
+        std::size_t         used        = 0;
+        std::size_t         overrun     = 0;
+        bool                stopped     = false;
+
+        void refill()
+        {
+            std::size_t left = end - pos;
+            std::copy(pos, end, buffer.data());
+            in->read(buffer.data() + left, bufferSize - left);
+            pos = buffer.data();
+            end = buffer.data() + left + in->gcount();
+        }
+
+        std::uint64_t read()
+        {
+            if (in && static_cast<std::size_t>(end - pos) < sizeof(std::uint64_t)) {
+                refill();
+            }
+            std::uint64_t   value = 0;
+            if (static_cast<std::size_t>(end - pos) < sizeof(std::uint64_t)) {
+                ++overrun;
+                return value;
+            }
+            std::copy(pos, pos + sizeof(value), reinterpret_cast<char*>(&value));
+            pos += sizeof(value);
+            return value;
+        }
+
+        public:
+            BitReader(std::istream& in)
+                : in(&in)
+                , buffer(bufferSize)
+                , pos(buffer.data())
+                , end(buffer.data())
+            {
+                current = read();
+                next    = read();
+            }
+            BitReader(std::span<char const> data)
+                : pos(data.data())
+                , end(data.data() + data.size())
+            {
+                current = read();
+                next    = read();
+            }
+
+            // The next 64 bits of the stream (most significant bit first).
+            std::uint64_t peek() const
+            {
+                return used == 0 ? current : (current << used) | (next >> (maxSize - used));
+            }
+
+            // Remove 'bits' from the front of the stream (bits <= 64).
+            void consume(std::size_t bits)
+            {
+                used += bits;
+                if (used >= maxSize) {
+                    used    -= maxSize;
+                    current = next;
+                    next    = read();
+                }
+            }
+
+            // We have moved past the end of the input stream.
+            // Note: One extra value is always read ahead.
+            bool exhausted() const
+            {
+                return overrun > 1;
+            }
+
+            // Decoding stopped because the input ran out before the EOF marker.
+            void stop()
+            {
+                stopped = true;
+            }
+
+            // The input ended before the EOF marker: decoding stopped (see stop()) or
+            // the EOF marker was decoded from the zero bits past the end of the input.
+            bool truncated() const
+            {
+                return stopped || overrun > 2 || (overrun == 2 && used != 0);
+            }
+    };
+}
+
+// Call action.operator()<TableBits, MaxLength>() for the kernel of the current tree.
+template<typename Action>
+decltype(auto) HuffmanDecoder::withKernel(Action&& action)
+{
+    switch (kernel) {
+        case Kernel::Short:     return action.template operator()<tableBits, tableBits>();
+        case Kernel::Medium:    return action.template operator()<tableBits, 15>();
+        default:                return action.template operator()<tableBits, 0>();
+    }
+}
+
+// The BitReader is only complete in this file.
+HuffmanDecoder::HuffmanDecoder()    = default;
+HuffmanDecoder::~HuffmanDecoder()   = default;
+
 // Decode the input stream using the Huffman stream place the output into out
 void HuffmanDecoder::decode(std::istream& in, std::ostream& out)
 {
-    std::uint64_t const   maxSize     = sizeof(std::uint64_t) * 8;
-    std::uint64_t const   maskBase    = (std::uint64_t{1} << (maxSize - 1));
+    BitReader           reader(in);
+    decode(reader, out);
+}
 
-    Node*               current     = root.get();
+void HuffmanDecoder::decode(std::span<char const> in, std::ostream& out)
+{
+    BitReader           reader(in);
+    decode(reader, out);
+}
 
-    bool finished = false;
+// Decode into a block of memory.
+// Note: Letters are copied in groups of maxLetters so out must have room for
+//       maxLetters bytes more than the decoded data.
+// Returns false if the EOF marker was not found before out was filled (or the input ran out).
+bool HuffmanDecoder::decode(std::span<char const> in, std::span<char> out, std::size_t& size)
+{
+    HuffmanStats::Timer timer(stats, HuffmanStats::Decode);
+    BitReader           reader(in);
+    bool                finished    = false;
+    char*               end         = withKernel([&]<std::size_t TableBits, std::size_t MaxLength>()
+    {
+        return decode<TableBits, MaxLength>(reader, out.data(), out.data() + out.size(), finished);
+    });
 
-    while (!finished) {
-        // Read the next vallue from the input stream.
-        std::uint64_t     currentValue;
-        in.read(reinterpret_cast<char*>(&currentValue), sizeof(currentValue));
+    size = end - out.data();
+    timer.setBytes(size);
+    return finished && !reader.truncated();
+}
 
-        // Loop over each of the bit this allows us to follow the Huffman
-        // tree to a leaf node and then output the value of the lead node.
-        for (std::uint64_t currentMask = maskBase; currentMask; currentMask >>= 1) {
+// Decode a stream a piece at a time.
+// The reader keeps its place in the stream between calls to decodeSome().
+void HuffmanDecoder::start(std::istream& in)
+{
+    source = std::make_unique<BitReader>(in);
+}
 
-            // Get the next bit.
-            bool branch = currentValue & currentMask;
-            // Update the position in the Huffman tree.
-            current     = branch ? current->right : current->left;
+std::size_t HuffmanDecoder::decodeSome(std::span<char> out, bool& finished, bool& truncated)
+{
+    finished    = false;
+    truncated   = false;
+    if (!source) {
+        finished = true;
+        return 0;
+    }
 
-            // If we are at a leaf node.
-            if (current->left == nullptr && current->right == nullptr) {
-                if (current->eof) {
-                    finished = true;
-                    break;
-                }
-                else {
-                    out << current->letter;
-                }
-                // Reset the current point in the Huffman tree to the root.
-                current = root.get();
+    HuffmanStats::Timer timer(stats, HuffmanStats::Decode);
+    char*               end         = withKernel([&]<std::size_t TableBits, std::size_t MaxLength>()
+    {
+        return decode<TableBits, MaxLength>(*source, out.data(), out.data() + out.size(), finished);
+    });
+    if (finished) {
+        truncated = source->truncated();
+        source.reset();
+    }
+
+    std::size_t         size        = end - out.data();
+    timer.setBytes(size);
+    return size;
+}
+
+void HuffmanDecoder::decode(BitReader& reader, std::ostream& out)
+{
+    static constexpr std::size_t bufferSize = 64 * 1024;
+
+    HuffmanStats::Timer timer(stats, HuffmanStats::Decode);
+    std::vector<char>   buffer(bufferSize + maxLetters);
+    bool                finished    = false;
+    std::size_t         charCount   = 0;
+
+    withKernel([&]<std::size_t TableBits, std::size_t MaxLength>()
+    {
+        while (!finished) {
+            char* end = decode<TableBits, MaxLength>(reader, buffer.data(), buffer.data() + buffer.size(), finished);
+            out.write(buffer.data(), end - buffer.data());
+            charCount += end - buffer.data();
+        }
+    });
+    timer.setBytes(charCount);
+}
+
+// Decode the letters of the next table entry.
+// Note: maxLetters are always copied to dst.
+// Returns false if the EOF marker was decoded.
+// When MaxLength fits in the table every entry decodes a letter (or the EOF marker)
+// so there is no long code path; otherwise MaxLength (if not zero) bounds the tree walk.
+template<std::size_t TableBits, std::size_t MaxLength>
+inline bool HuffmanDecoder::decodeNext(BitReader& reader, char*& dst) const
+{
+    static constexpr bool longCodes = MaxLength == 0 || MaxLength > TableBits;
+
+    // Resolve the next 'TableBits' bits with a single lookup.
+    TableEntry const& entry = table[reader.peek() >> (64 - TableBits)];
+
+    if (!longCodes || entry.count != 0 || entry.eof) {
+        std::copy(std::begin(entry.letters), std::end(entry.letters), dst);
+        dst += entry.count;
+        reader.consume(entry.bits);
+        return !entry.eof;
+    }
+
+    // Long code: follow the Huffman tree one bit at a time
+    // from the node the table reached.
+    reader.consume(TableBits);
+    Node const* current = &tree.nodes[entry.node];
+    if constexpr (MaxLength != 0) {
+        for (std::size_t step = TableBits; step < MaxLength && !current->isLeaf(); ++step) {
+            bool branch = reader.peek() >> 63;
+            current     = &tree.nodes[branch ? current->right : current->left];
+            reader.consume(1);
+        }
+    }
+    else {
+        while (!current->isLeaf()) {
+            bool branch = reader.peek() >> 63;
+            current     = &tree.nodes[branch ? current->right : current->left];
+            reader.consume(1);
+        }
+    }
+    if (current->symbol == 256) {
+        return false;
+    }
+    *dst++ = static_cast<char>(current->symbol);
+    return true;
+}
+
+// Decode the letters of the next lookupsPerRead table entries.
+// Only used when every entry decodes a letter: all the entries come from a single read of the stream.
+// Note: lookupsPerRead * maxLetters are always copied to dst.
+// Returns false if the EOF marker was decoded.
+template<std::size_t TableBits, std::size_t MaxLength>
+inline bool HuffmanDecoder::decodeGroup(BitReader& reader, char*& dst) const
+{
+    static_assert(MaxLength != 0 && MaxLength <= TableBits && lookupsPerRead * TableBits <= 64);
+
+    std::uint64_t       bits    = reader.peek();
+    std::size_t         used    = 0;
+    for (std::size_t loop = 0; loop < lookupsPerRead; ++loop) {
+        TableEntry const&   entry   = table[bits >> (64 - TableBits)];
+        std::copy(std::begin(entry.letters), std::end(entry.letters), dst);
+        dst     += entry.count;
+        bits    <<= entry.bits;
+        used    += entry.bits;
+        if (entry.eof) {
+            reader.consume(used);
+            return false;
+        }
+    }
+    reader.consume(used);
+    return true;
+}
+
+// Decode letters into [dst, dstEnd) until the EOF marker is found (finished is set to true)
+// or there is no longer space for maxLetters in the output.
+// Returns the end of the decoded letters.
+template<std::size_t TableBits, std::size_t MaxLength>
+char* HuffmanDecoder::decode(BitReader& reader, char* dst, char* dstEnd, bool& finished)
+{
+    if constexpr (MaxLength != 0 && MaxLength <= TableBits) {
+        while (dstEnd - dst >= static_cast<std::ptrdiff_t>(lookupsPerRead * maxLetters)) {
+            if (reader.exhausted()) {
+                // Corrupt stream: There was no EOF marker.
+                reader.stop();
+                finished = true;
+                return dst;
+            }
+            if (!decodeGroup<TableBits, MaxLength>(reader, dst)) {
+                finished = true;
+                return dst;
             }
         }
     }
+    while (dstEnd - dst >= static_cast<std::ptrdiff_t>(maxLetters)) {
+        if (reader.exhausted()) {
+            // Corrupt stream: There was no EOF marker.
+            reader.stop();
+            finished = true;
+            break;
+        }
+        if (!decodeNext<TableBits, MaxLength>(reader, dst)) {
+            finished = true;
+            break;
+        }
+    }
+    return dst;
+}
+
+// Decode the output of HuffmanEncoder::encodeStreams() into a block of memory.
+// Each iteration of the main loop decodes one table entry from every stream.
+// The streams do not depend on each other so the processor can work on all of them at once.
+bool HuffmanDecoder::decodeStreams(std::span<char const> in, std::span<char> out, std::size_t size)
+{
+    static constexpr std::size_t headerSize = (streamCount - 1) * sizeof(std::uint64_t);
+
+    HuffmanStats::Timer timer(stats, HuffmanStats::Decode, size);
+    if (in.size() < headerSize || out.size() < size + maxLetters) {
+        return false;
+    }
+    std::array<std::uint64_t, streamCount>  sizes;
+    std::memcpy(sizes.data(), in.data(), headerSize);
+    in = in.subspan(headerSize);
+
+    std::uint64_t   used = 0;
+    for (std::size_t loop = 0; loop < streamCount - 1; ++loop) {
+        if (sizes[loop] > in.size() - used) {
+            return false;
+        }
+        used += sizes[loop];
+    }
+    sizes[streamCount - 1] = in.size() - used;
+
+    // Each stream has its own reader and decodes into its own segment of the output.
+    std::size_t                 segment = segmentSize(size);
+    std::vector<BitReader>      readers;
+    std::array<char*, streamCount>  dst;
+    std::array<char*, streamCount>  dstEnd;
+    readers.reserve(streamCount);
+    for (std::size_t loop = 0; loop < streamCount; ++loop) {
+        readers.emplace_back(in.first(sizes[loop]));
+        in = in.subspan(sizes[loop]);
+
+        dst[loop]       = out.data() + std::min(size, loop * segment);
+        dstEnd[loop]    = out.data() + std::min(size, (loop + 1) * segment);
+    }
+
+    return withKernel([&]<std::size_t TableBits, std::size_t MaxLength>()
+    {
+        if (!decodeSegments<TableBits, MaxLength>(readers.data(), dst, dstEnd)) {
+            return false;
+        }
+
+        // Finish each stream on its own.
+        for (std::size_t loop = 0; loop < streamCount; ++loop) {
+            bool    finished    = false;
+            dst[loop] = decodeBounded<TableBits, MaxLength>(readers[loop], dst[loop], dstEnd[loop], finished);
+            if (!finished || dst[loop] != dstEnd[loop]) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+// Copying maxLetters at a time must not write into the next segment.
+// Each entry decodes at most maxLetters so we can work out how many iterations
+// are safe before checking again (rather than checking each iteration).
+template<std::size_t TableBits, std::size_t MaxLength>
+bool HuffmanDecoder::decodeSegments(BitReader* readers, std::array<char*, streamCount>& dst, std::array<char*, streamCount> const& dstEnd)
+{
+    static_assert(streamCount == 4);
+    BitReader&      reader0 = readers[0];
+    BitReader&      reader1 = readers[1];
+    BitReader&      reader2 = readers[2];
+    BitReader&      reader3 = readers[3];
+    char*           dst0    = dst[0];
+    char*           dst1    = dst[1];
+    char*           dst2    = dst[2];
+    char*           dst3    = dst[3];
+    while (true) {
+        std::size_t     space   = std::min({dstEnd[0] - dst0, dstEnd[1] - dst1, dstEnd[2] - dst2, dstEnd[3] - dst3});
+        std::size_t     count   = space / maxLetters;
+        if (count == 0) {
+            break;
+        }
+        for (; count != 0; --count) {
+            bool more   = decodeNext<TableBits, MaxLength>(reader0, dst0);
+            more        &= decodeNext<TableBits, MaxLength>(reader1, dst1);
+            more        &= decodeNext<TableBits, MaxLength>(reader2, dst2);
+            more        &= decodeNext<TableBits, MaxLength>(reader3, dst3);
+            if (!more) {
+                // Corrupt stream: The EOF marker is before the end of the segment.
+                return false;
+            }
+        }
+    }
+    dst = {dst0, dst1, dst2, dst3};
+    return true;
+}
+
+// Decode letters into [dst, dstEnd) without writing past dstEnd.
+// The last few letters go through a small buffer so the copy does not overrun the output.
+// finished is false if the EOF marker was not found before the output was full (or the input ran out first).
+template<std::size_t TableBits, std::size_t MaxLength>
+char* HuffmanDecoder::decodeBounded(BitReader& reader, char* dst, char* dstEnd, bool& finished)
+{
+    dst = decode<TableBits, MaxLength>(reader, dst, dstEnd, finished);
+    if (!finished) {
+        char    tail[2 * maxLetters];
+        char*   end = decode<TableBits, MaxLength>(reader, tail, tail + sizeof(tail), finished);
+        if (end - tail > dstEnd - dst) {
+            finished = false;
+            return dst;
+        }
+        dst = std::copy(tail, end, dst);
+    }
+    if (reader.truncated()) {
+        // The input ran out before the EOF marker.
+        finished = false;
+    }
+    return dst;
+}
+
+// Decompress the output of HuffmanEncoder::compress() into a caller provided buffer.
+bool HuffmanDecoder::decompress(std::span<std::byte const> in, std::span<std::byte> out, std::size_t& size)
+{
+    std::size_t     header;
+    if (!in.empty() && in[0] == std::byte{HuffmanDictionary::marker}) {
+        std::uint32_t   id;
+        header = HuffmanDictionary::headerSize;
+        if (in.size() < header) {
+            return false;
+        }
+        std::memcpy(&id, in.data() + 1, sizeof(id));
+        if (!useDictionary(id)) {
+            return false;
+        }
+    }
+    else {
+        CodeLengths     lengths;
+        header = 1 + lengths.size();
+        if (in.size() < header || in[0] != std::byte{'L'}) {
+            return false;
+        }
+        std::memcpy(lengths.data(), in.data() + 1, lengths.size());
+        if (!buildTree(lengths)) {
+            return false;
+        }
+    }
+
+    HuffmanStats::Timer timer(stats, HuffmanStats::Decode);
+    BitReader       reader({reinterpret_cast<char const*>(in.data()) + header, in.size() - header});
+    char*           begin       = reinterpret_cast<char*>(out.data());
+    bool            finished    = false;
+    char*           end         = withKernel([&]<std::size_t TableBits, std::size_t MaxLength>()
+    {
+        return decodeBounded<TableBits, MaxLength>(reader, begin, begin + out.size(), finished);
+    });
+
+    size = end - begin;
+    timer.setBytes(size);
+    return finished;
 }
@@ -2,117 +2,346 @@
 #define THORSANVIL_PUZZLE_HUFFMAN_H
 
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <utility>
 #include <queue>
 #include <vector>
 #include <functional>
 #include <algorithm>
+#include <array>
+#include <span>
 #include <memory>
+#include <optional>
 
 
 namespace ThorsAnvil::Puzzle
 {
 
+class BitReader;
+class BitWriter;
+class HuffmanStats;
+class HuffmanDictionary;
+
 class Huffman
 {
+    public:
+        // Nodes[0-255] represent the ASCII char set.
+        // Nodes[256]   represents the EOF character.
+        static constexpr std::size_t symbolCount            = 257;
+
+        // Canonical codes are limited in length so they always fit in a machine word.
+        // The lower bound is the shortest limit that can still represent all 257 symbols.
+        static constexpr std::size_t minCodeLength          = 9;
+        static constexpr std::size_t maxCodeLength          = 32;
+        static constexpr std::size_t defaultMaxCodeLength   = 15;
+
+        // The length (in bits) of the code used for each symbol.
+        // A length of zero means the symbol is not used.
+        // Canonical Huffman codes can be rebuilt from this table alone.
+        using CodeLengths = std::array<std::uint8_t, symbolCount>;
+
+        // The representation of a symbol in the encoded stream.
+        // The value (which fits in length bits) is written most significant bit first.
+        struct Code
+        {
+            std::uint64_t       value   = 0;
+            std::uint64_t       length  = 0;
+        };
+
+        // A block can be encoded as several independent bitstreams (see encodeStreams()).
+        // Stream 'n' encodes the bytes [n * segmentSize(size), (n + 1) * segmentSize(size)) of the block.
+        static constexpr std::size_t streamCount            = 4;
+        static std::size_t segmentSize(std::size_t size)    {return (size + streamCount - 1) / streamCount;}
+
+        // The number of times each byte value occurs in the input.
+        using Histogram = std::array<std::uint64_t, 256>;
+
+        // Add the bytes in input to the histogram.
+        // This is the counting pass of the encoder (exposed so it can be timed on its own).
+        static void histogram(std::span<char const> input, Histogram& counts);
+
     protected:
-    struct Node
-    {
-        std::size_t     cost        = 0;
-        bool            dynamic     = false;
-        // Leaf Nodes
-        // These will have either eof set to true or a letter value.
-        bool            eof         = false;
-        unsigned char   letter      = '\0';
-        // Leaf nodes we calculate the representation of the leaf in the file.
-        // The size is the number of bits needed.
-        // The value (which fits in size bits) that represents this leaf node when
-        // it is serialized into a file.
-        std::size_t     size        = 0;
-        std::size_t     value       = 0;
-        // Non-Leaf nodes (don't use eof/letter)
-        // Expected to have both left and right value;
-        Node*           left        = nullptr;
-        Node*           right       = nullptr;
-
-        // Default constructor used to create automatic storage duration objects.
-        // This is used in the code below to create an array of Node objects.
-        // Note: This class is a private class that can only be used in
-        //       HuffmanEncoder and HuffmanDecoder and it thus this restriction is observed.
-        Node() = default;
-
-        // This deletes a Huffman tree.
-        // Note the encoder builds the tree using Nodes from an array.
-        //      The nodes in the array are not dynamically allocated and thus should not
-        //      be deleted.
-        ~Node();
-
-        // Build a non leaf node
-        Node(std::size_t cost, Node* left, Node* right);
-
-        // Used to read a Huffman tree dynamically from the head of a file.
-        // The tree is serialized via exportTree() (see below)
-        // The user is expected to check ok and eofMark are both true after is read
-        Node(std::istream& str, std::size_t pSize, std::size_t pValue, bool& ok, bool& eofMark);
-
-        // Encode a Huffman tree to a stream.
-        void exportTree(std::ostream& str);
-
-        // Once a Hoffman tree is built from scratch.
-        // Call this function to calculate the representation of each letter.
-        // Also calculate the size of the output file that will be generated.
-        std::size_t setName();
-
-        private:
-            // Sets the value of each lead node and how it is represented.
-            // Return data about the amount of data that will written to the output.
-            //  first:  Number of bytes representing the Hoffman tree when encoding.
-            //  second: Number of bits to represent the data of the file.
-            using DataSize = std::pair<std::size_t, std::size_t>;
-            DataSize setName(std::size_t pSize, std::size_t pValue);
-    };
+        // Canonical Huffman codes.
+        // Codes are assigned in order of length then symbol value.
+        using CodeValues = std::array<std::uint64_t, symbolCount>;
+        static CodeValues canonicalValues(CodeLengths const& lengths);
+
+        // The Huffman tree is held in a single array of nodes.
+        // Nodes refer to their children by index into the array.
+        // The root is always nodes[0] so a child index of zero means "no child".
+        // A tree with symbolCount leaves has (2 * symbolCount - 1) nodes.
+        static constexpr std::size_t maxNodes = 2 * symbolCount - 1;
+
+        struct Node
+        {
+            // Non-Leaf nodes (don't use symbol)
+            // Expected to have both left and right value;
+            std::uint16_t   left        = 0;
+            std::uint16_t   right       = 0;
+            // Leaf nodes
+            // Nodes[0-255] represent the ASCII char set.
+            // Nodes[256]   represents the EOF character.
+            std::uint16_t   symbol      = 0;
+
+            bool isLeaf() const {return left == 0;}
+        };
+
+        struct Tree
+        {
+            std::array<Node, maxNodes>  nodes;
+            std::size_t                 size        = 0;
+
+            // Add a node to the end of the array and return its index.
+            std::uint16_t add(Node const& node)
+            {
+                nodes[size] = node;
+                return static_cast<std::uint16_t>(size++);
+            }
+
+            // Read a Huffman tree from the head of a file.
+            // The tree is serialized via exportTree() (see below)
+            // Returns false if the tree is invalid or does not contain the EOF marker.
+            bool importTree(std::istream& str);
+
+            // Encode a Huffman tree to a stream.
+            // The nodes are written in pre-order:
+            //  'N'             Non-Leaf node (followed by the left and right sub-trees)
+            //  'C' <letter>    Leaf node for a letter
+            //  'Z'             Leaf node for the EOF marker
+            void exportTree(std::ostream& str) const;
+
+            // Calculate the representation of each symbol from its position in the tree.
+            // Symbols that are not in the tree get a length of zero.
+            void assignCodes(std::array<Code, symbolCount>& codes) const;
+        };
 };
 
 class HuffmanEncoder: public Huffman
 {
     private:
-        // Nodes[0-255] represent the ASCII char set.
-        // Nodes[256]   represents the EOF character.
-        // The constructor initializes this array correctly.
-        Node                    count[257];
+        // The number of times each symbol occurs in the input.
+        // The EOF marker occurs exactly once.
+        std::array<std::uint64_t, symbolCount>  costs;
+
+        // The Hoffman tree.
+        Tree                    tree;
+
+        // The representation of each symbol (calculated from the tree).
+        // A flat table keeps the encode loop away from the tree nodes.
+        std::array<Code, symbolCount>   codes;
+        std::size_t             longestCode = 0;
+
+        // When canonical is true the tree is reduced to canonical codes no longer
+        // than codeLengthLimit bits and the header is a table of code lengths.
+        bool                    canonical;
+        std::size_t             codeLengthLimit;
 
-        // The root of a Hoffman tree.
-        std::unique_ptr<Node>   root;
+        // The id of the dictionary the code is taken from rather than built from the input (see useDictionary()).
+        std::optional<std::uint32_t>    dictionaryId;
+
+        HuffmanStats*           stats       = nullptr;
 
     public:
-        HuffmanEncoder();
+        HuffmanEncoder(bool canonical = false, std::size_t codeLengthLimit = defaultMaxCodeLength);
+
+        // Record the time spent in each phase (and the code statistics) in stats.
+        void setStats(HuffmanStats* value)     {stats = value;}
+
+        // Use the code of a dictionary (until buildTree() is called).
+        // There is no histogram pass so encode() can be called straight away and the
+        // header written by exportTree() is the id of the dictionary (not the code).
+        // The code is copied so the dictionary does not need to outlive the call.
+        void useDictionary(HuffmanDictionary const& value);
 
         bool buildTree(std::istream& input);
 
+        // Count the characters in a block of memory and build the Hoffman tree.
+        // Returns the number of bytes exportTree() and encode() will generate (0 if the block is empty).
+        // Note: Unlike the stream version this never refuses to build the tree.
+        std::size_t buildTree(std::span<char const> input);
+
+        // Build the Hoffman tree from a histogram of the input.
+        // Returns the number of bytes exportTree() and encode() will generate (0 if the histogram is empty).
+        std::size_t buildTree(Histogram const& histogram);
+
         // Export the Hoffman tree to the file.
         void exportTree(std::ostream& out);
 
+        // The length of the code for each symbol.
+        CodeLengths codeLengths() const;
+
         // using the Hoffman tree encode the input file to the output file.
         void encode(std::istream& in, std::ostream& out);
+        void encode(std::span<char const> in, std::ostream& out);
+
+        // Encode the input as streamCount independent bitstreams (each terminated by the EOF marker).
+        // The decoder can follow all the streams at the same time.
+        //  std::uint64_t       Size in bytes of each stream except the last.
+        //  std::uint64_t*      The streams one after the other.
+        void encodeStreams(std::span<char const> in, std::ostream& out);
+
+        // Compress a block of memory into a caller provided buffer.
+        // The output is a code length table followed by the encoded data (the same as a file
+        // compressed with --canonical) and is always limited to codeLengthLimit bits per symbol.
+        // With a dictionary (see useDictionary()) the output is the dictionary header followed by the
+        // encoded data and out must be at least maxCompressedSize() bytes (the size is not known in advance).
+        // Once the object has been used compression does not allocate memory.
+        // Returns the number of bytes written to out.
+        // Returns 0 if out is too small (or in is empty).
+        std::size_t compress(std::span<std::byte const> in, std::span<std::byte> out);
+
+        // The largest output compress() can generate for an input of 'size' bytes.
+        std::size_t maxCompressedSize(std::size_t size) const;
 
     private:
-        // Encode a sing character 'c'
-        // If this fills the 'currentVal' object then write to the file.
-        void add(std::ostream& out, Node* count, std::uint64_t const& maxSize, std::uint64_t& currentLen, std::uint64_t& currentVal, int c);
+        std::size_t buildTree(Histogram const& histogram, bool canonicalCodes);
+
+        // Build the Hoffman tree from the character counts.
+        // Returns the number of bytes that will be sent to the stream.
+        std::size_t makeTree(bool canonicalCodes);
+
+        // Limit the code lengths to codeLengthLimit and assign canonical codes.
+        // Returns the number of bytes that will be sent to the stream.
+        std::size_t makeCanonical();
+
+        // Encode a block of characters.
+        void encode(std::span<char const> in, BitWriter& writer);
+
+        // compress() with the code of a dictionary.
+        std::size_t compressWithDictionary(std::span<char const> data, std::span<std::byte> out);
 };
 
 class HuffmanDecoder: public Huffman
 {
+    public:
+        // Number of bits of the input stream that are resolved with a single table lookup.
+        static constexpr std::size_t tableBits      = 11;
+        static constexpr std::size_t tableSize      = std::size_t{1} << tableBits;
+        // Maximum number of letters that can be decoded by a single table lookup.
+        static constexpr std::size_t maxLetters     = 4;
+        // When all the codes fit in the table this many lookups are made for each read of the input.
+        static constexpr std::size_t lookupsPerRead = 4;
+
     private:
-        std::unique_ptr<Node>   root;
+        // Each entry in the decode table represents the next 'tableBits' bits of the input.
+        //  count:      The number of letters fully decoded by these bits (stored in letters).
+        //  eof:        The EOF marker was decoded after the letters.
+        //  bits:       The number of bits used to decode the letters (and EOF).
+        //  node:       If count is zero and eof is false then the code is longer than 'tableBits'.
+        //              This is the index of the node in the Huffman tree reached after reading
+        //              'tableBits' bits and decoding continues one bit at a time from here.
+        struct TableEntry
+        {
+            std::uint8_t    count       = 0;
+            bool            eof         = false;
+            std::uint8_t    bits        = 0;
+            unsigned char   letters[maxLetters] = {};
+            std::uint16_t   node        = 0;
+        };
+
+        // The decode loops are compiled for the width of the table and the longest code
+        // (a template for each) and the one that matches the tree is picked by buildTable().
+        //  Short:      Codes that fit in the table. Every table entry decodes a letter so there is
+        //              no long code path and several lookups are made from each read of the input.
+        //  Medium:     Codes of up to 15 bits (the long code path is at most 4 steps).
+        //  Long:       Any length.
+        enum class Kernel {Short, Medium, Long};
+
+        Tree                    tree;
+        std::vector<TableEntry> table;
+        Kernel                  kernel      = Kernel::Long;
+
+        // The stream being decoded a piece at a time (see start()).
+        std::unique_ptr<BitReader>  source;
+
+        // The dictionary the tree was built from (so it is only rebuilt when the dictionary changes).
+        std::optional<std::uint32_t>    dictionaryId;
+        CodeLengths                     dictionaryLengths{};
+
+        HuffmanStats*           stats       = nullptr;
 
     public:
+        HuffmanDecoder();
+        ~HuffmanDecoder();
+
+        // Record the time spent in each phase in stats.
+        void setStats(HuffmanStats* value)     {stats = value;}
+
         // Read the Huffman tree from the input stream.
+        // The header is a tree, a code length table or the id of a dictionary (see useDictionary()).
         bool buildTree(std::istream& input);
 
+        // Build the tree of canonical codes from a table of code lengths.
+        bool buildTree(CodeLengths const& lengths);
+
+        // Use the code of a registered dictionary (see HuffmanDictionary::find()).
+        // Nothing is rebuilt if the decoder is already using the dictionary (the same id and code).
+        // Returns false if there is no dictionary with the id.
+        bool useDictionary(std::uint32_t id);
+
         // Decode the input stream using the Hoffman stream place the output into out
         void decode(std::istream& in, std::ostream& out);
+        void decode(std::span<char const> in, std::ostream& out);
+
+        // Decode into a block of memory.
+        // Note: Letters are copied in groups of maxLetters so out must have room for
+        //       maxLetters bytes more than the decoded data.
+        // Returns false if the EOF marker was not found before out was filled (or the input ran out).
+        bool decode(std::span<char const> in, std::span<char> out, std::size_t& size);
+
+        // Decode a stream a piece at a time (so the output does not need to be held in memory).
+        // start() is called after buildTree() with the stream positioned after the tree.
+        // Each call to decodeSome() decodes the next letters into out and sets finished once the
+        // EOF marker is found (or the stream ends without one: then truncated is also set).
+        // Note: out must have room for more than maxLetters bytes.
+        // Returns the number of bytes decoded.
+        void        start(std::istream& in);
+        std::size_t decodeSome(std::span<char> out, bool& finished, bool& truncated);
+
+        // Decode the output of HuffmanEncoder::encodeStreams() into a block of memory.
+        // Note: out must have room for maxLetters bytes more than size.
+        // Returns false unless exactly size bytes are decoded.
+        bool decodeStreams(std::span<char const> in, std::span<char> out, std::size_t size);
+
+        // Decompress the output of HuffmanEncoder::compress() (with or without a dictionary) into a caller provided buffer.
+        // Unlike decode() no extra room is needed at the end of out.
+        // Once the object has been used decompression does not allocate memory.
+        // Returns false if in is not valid or the output does not fit in out.
+        bool decompress(std::span<std::byte const> in, std::span<std::byte> out, std::size_t& size);
+
+    private:
+        // Call action.operator()<TableBits, MaxLength>() for the kernel of the current tree.
+        // A MaxLength of zero means there is no limit.
+        template<typename Action>
+        decltype(auto) withKernel(Action&& action);
+
+        void decode(BitReader& reader, std::ostream& out);
+        template<std::size_t TableBits, std::size_t MaxLength>
+        char* decode(BitReader& reader, char* dst, char* dstEnd, bool& finished);
+
+        // Decode letters into [dst, dstEnd) without writing past dstEnd.
+        template<std::size_t TableBits, std::size_t MaxLength>
+        char* decodeBounded(BitReader& reader, char* dst, char* dstEnd, bool& finished);
+
+        // Decode the letters of the next table entry.
+        // Returns false if the EOF marker was decoded.
+        template<std::size_t TableBits, std::size_t MaxLength>
+        bool decodeNext(BitReader& reader, char*& dst) const;
+
+        // Decode the letters of the next lookupsPerRead table entries (codes that fit in the table only).
+        template<std::size_t TableBits, std::size_t MaxLength>
+        bool decodeGroup(BitReader& reader, char*& dst) const;
+
+        // The main loop of decodeStreams().
+        template<std::size_t TableBits, std::size_t MaxLength>
+        bool decodeSegments(BitReader* readers, std::array<char*, streamCount>& dst, std::array<char*, streamCount> const& dstEnd);
+
+        // Read a table of code lengths and build the tree of canonical codes.
+        bool buildCanonicalTree(std::istream& input);
+
+        // Build the decode table from the Huffman tree.
+        void buildTable();
 };
 
 }
@@ -0,0 +1,677 @@
+#include "HuffmanBlock.h"
+#include "HuffmanIO.h"
+#include "HuffmanLZ.h"
+#include "HuffmanStats.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <optional>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+
+using namespace ThorsAnvil::Puzzle;
+
+namespace
+{
+    void writeValue(std::ostream& out, std::uint64_t value)
+    {
+        out.write(reinterpret_cast<char const*>(&value), sizeof(value));
+    }
+
+    bool readValue(std::istream& in, std::uint64_t& value)
+    {
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+    }
+
+    std::size_t threadCount(std::size_t threads)
+    {
+        return threads != 0 ? threads : std::max(std::thread::hardware_concurrency(), 1U);
+    }
+
+    // The LZ encoder has large hash tables.
+    // So each worker thread builds one and reuses it for all the blocks it compresses.
+    HuffmanLZEncoder& lzEncoder(std::size_t codeLengthLimit)
+    {
+        thread_local std::optional<HuffmanLZEncoder>    encoder;
+        thread_local std::size_t                        encoderLimit = 0;
+        if (!encoder || encoderLimit != codeLengthLimit) {
+            encoder.emplace(codeLengthLimit);
+            encoderLimit = codeLengthLimit;
+        }
+        return *encoder;
+    }
+
+    // A block of work for orderedParallel().
+    struct Job
+    {
+        std::size_t             id      = 0;    // The order the job was read.
+        std::vector<char>       input;          // Buffer for input read from a stream.
+        std::span<char const>   data;           // The input to process (input or a view of a mapped file).
+        std::string             output;
+        bool                ok      = true;
+        bool                done    = false;
+    };
+
+    // A reader thread uses read() to fill jobs and the calling thread uses write() to consume them.
+    // Worker threads call process() on each job.
+    // write() is called on the jobs in the same order they were read.
+    // Reading has its own thread so a job is written as soon as it (and the jobs before it) are done:
+    // when the input is a pipe a blocked read() does not hold back the output.
+    //
+    // A fixed number of jobs are in flight at any point (so memory use is bounded).
+    // Job 'n' is stored in jobs[n % jobs.size()].
+    //
+    //  bool read(Job&):     Returns false when there is no more input.
+    //  void process(Job&):
+    //  bool write(Job&):    Returns false to stop processing.
+    //
+    // Note: If processing stops early (write() returns false or there is an exception) a read()
+    //       that is in progress is allowed to finish before this returns.
+    template<typename Read, typename Process, typename Write>
+    void orderedParallel(std::size_t threads, Read&& read, Process&& process, Write&& write)
+    {
+        std::vector<Job>            jobs(threads * 2);
+        std::mutex                  mutex;
+        std::condition_variable     workAvailable;
+        std::condition_variable     workDone;
+        std::condition_variable     slotFree;
+        std::size_t                 readCount   = 0;    // Jobs read from the input.
+        std::size_t                 takeCount   = 0;    // Jobs taken by a worker.
+        std::size_t                 writeCount  = 0;    // Jobs written to the output.
+        bool                        inputDone   = false;
+        bool                        finished    = false;
+        std::exception_ptr          error;
+
+        auto setError = [&](std::exception_ptr exception)
+        {
+            std::lock_guard     lock(mutex);
+            if (!error) {
+                error = exception;
+            }
+            workDone.notify_all();
+        };
+
+        auto worker = [&]()
+        {
+            std::unique_lock    lock(mutex);
+            while (true) {
+                workAvailable.wait(lock, [&](){return finished || takeCount < readCount;});
+                if (takeCount == readCount) {
+                    return;
+                }
+                Job& job = jobs[takeCount++ % jobs.size()];
+                lock.unlock();
+
+                try {
+                    process(job);
+                }
+                catch (...) {
+                    setError(std::current_exception());
+                }
+
+                lock.lock();
+                job.done = true;
+                workDone.notify_all();
+            }
+        };
+
+        // Keep all the job slots full.
+        // Only the reader modifies a slot that has been written (and not yet handed to the workers).
+        auto reader = [&]()
+        {
+            try {
+                while (true) {
+                    {
+                        std::unique_lock    lock(mutex);
+                        slotFree.wait(lock, [&](){return finished || readCount - writeCount < jobs.size();});
+                        if (finished) {
+                            break;
+                        }
+                    }
+                    Job& job    = jobs[readCount % jobs.size()];
+                    job.id      = readCount;
+                    job.ok      = true;
+                    bool    more = read(job);
+
+                    std::lock_guard     lock(mutex);
+                    if (!more || finished) {
+                        break;
+                    }
+                    ++readCount;
+                    workAvailable.notify_one();
+                }
+            }
+            catch (...) {
+                setError(std::current_exception());
+            }
+            std::lock_guard     lock(mutex);
+            inputDone = true;
+            workDone.notify_all();
+        };
+
+        std::vector<std::thread>    workers;
+        for (std::size_t loop = 0; loop < threads; ++loop) {
+            workers.emplace_back(worker);
+        }
+        workers.emplace_back(reader);
+
+        // An exception from write() stops the processing.
+        // The threads are still stopped and joined (below) before it is passed on.
+        try {
+            while (true) {
+                Job* job = nullptr;
+                {
+                    std::unique_lock    lock(mutex);
+                    workDone.wait(lock, [&](){return error || (writeCount < readCount && jobs[writeCount % jobs.size()].done) || (inputDone && writeCount == readCount);});
+                    if (error || writeCount == readCount) {
+                        break;
+                    }
+                    job = &jobs[writeCount % jobs.size()];
+                }
+                bool    more = write(*job);
+
+                std::lock_guard     lock(mutex);
+                job->done   = false;
+                job->output = std::string{};
+                ++writeCount;
+                slotFree.notify_one();
+                if (!more) {
+                    break;
+                }
+            }
+        }
+        catch (...) {
+            setError(std::current_exception());
+        }
+
+        {
+            std::lock_guard     lock(mutex);
+            finished    = true;
+            takeCount   = readCount;
+            workAvailable.notify_all();
+            slotFree.notify_all();
+        }
+        for (auto& thread: workers) {
+            thread.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+// The largest payload a block of 'size' bytes can generate.
+// The code length table plus every symbol (and the EOF marker) using the longest code.
+// When the block is split into streams each stream has its own EOF marker and padding.
+std::size_t HuffmanBlock::maxPayloadSize(std::size_t size)
+{
+    std::size_t streams     = Huffman::streamCount;
+    std::size_t headerSize  = 1 + Huffman::symbolCount + (streams - 1) * sizeof(std::uint64_t);
+    std::size_t maxBits     = (size + streams) * Huffman::maxCodeLength;
+    return headerSize + ((maxBits + 63) / 64 + streams) * sizeof(std::uint64_t);
+}
+
+HuffmanBlockEncoder::HuffmanBlockEncoder(std::size_t blockSize, std::size_t threads, std::size_t codeLengthLimit, Coding coding)
+    : blockSize(std::clamp(blockSize, std::size_t{1}, coding == Coding::LZ ? HuffmanLZ::maxInputSize : std::numeric_limits<std::size_t>::max()))
+    , threads(threadCount(threads))
+    , codeLengthLimit(codeLengthLimit)
+    , coding(coding)
+{}
+
+// Compress a single block with its own canonical code.
+// The histogram is used to pick a cheaper way to store the blocks that do not suit Huffman coding:
+//  A block that is a single repeated byte is stored as that byte.
+//  A block that does not get smaller is stored as is.
+std::string HuffmanBlockEncoder::encodeBlock(std::span<char const> block) const
+{
+    // For Coding::Interleaved each stream is counted on its own (to work out the size of the streams).
+    Huffman::Histogram  counts{};
+    std::array<Huffman::Histogram, Huffman::streamCount>    streamCounts{};
+    {
+        HuffmanStats::Timer timer(stats, HuffmanStats::Histogram, block.size());
+        if (coding == Coding::Interleaved) {
+            std::size_t     segment = Huffman::segmentSize(block.size());
+            for (std::size_t loop = 0; loop < Huffman::streamCount; ++loop) {
+                std::span<char const>   data = block.subspan(std::min(block.size(), loop * segment));
+                Huffman::histogram(data.first(std::min(segment, data.size())), streamCounts[loop]);
+                std::transform(std::begin(counts), std::end(counts), std::begin(streamCounts[loop]), std::begin(counts), std::plus<>{});
+            }
+        }
+        else {
+            Huffman::histogram(block, counts);
+        }
+    }
+    if (std::count(std::begin(counts), std::end(counts), 0) == static_cast<std::ptrdiff_t>(counts.size() - 1)) {
+        return {runLength, block[0]};
+    }
+
+    // The marker of the blocks that are not Huffman coded is counted as header.
+    auto storeBlock = [&]()
+    {
+        std::string     payload(1 + block.size(), stored);
+        std::copy(std::begin(block), std::end(block), std::begin(payload) + 1);
+        if (stats) {
+            stats->addHeader(1);
+        }
+        return payload;
+    };
+
+    // buildTree() gives the exact size of the Huffman coded payload.
+    // So LZ is only used when it is better than Huffman coding on its own.
+    HuffmanEncoder      encoder(true, codeLengthLimit);
+    encoder.setStats(stats);
+    std::size_t         cost = encoder.buildTree(counts);
+    if (coding == Coding::Interleaved) {
+        // The 'M' payload is the code lengths, the size of each stream (but the last) and the
+        // streams (each has its own EOF marker and is padded to a whole std::uint64_t).
+        Huffman::CodeLengths    lengths = encoder.codeLengths();
+        cost = 1 + lengths.size() + (Huffman::streamCount - 1) * sizeof(std::uint64_t);
+        for (auto const& streamCount: streamCounts) {
+            std::uint64_t       bits = lengths[256];
+            for (std::size_t symbol = 0; symbol < streamCount.size(); ++symbol) {
+                bits += streamCount[symbol] * lengths[symbol];
+            }
+            cost += (bits + 63) / 64 * sizeof(std::uint64_t);
+        }
+    }
+    if (coding == Coding::LZ) {
+        HuffmanStats::Timer timer(stats, HuffmanStats::Encode, block.size());
+        std::string         payload(1, lz);
+        lzEncoder(codeLengthLimit).encode(block, payload);
+        if (payload.size() < std::min(cost, block.size())) {
+            if (stats) {
+                stats->addHeader(1);
+            }
+            return payload;
+        }
+        // The time was spent whether or not the LZ payload is used.
+        // But only the bytes of the data that is LZ coded are counted.
+        timer.setBytes(0);
+    }
+    if (cost >= block.size()) {
+        return storeBlock();
+    }
+
+    std::ostringstream  payload;
+    if (coding == Coding::Interleaved) {
+        {
+            HuffmanStats::Timer     timer(stats, HuffmanStats::ExportTree);
+            Huffman::CodeLengths    lengths = encoder.codeLengths();
+            payload.put(multiStream);
+            payload.write(reinterpret_cast<char const*>(lengths.data()), lengths.size());
+            if (stats) {
+                stats->addHeader(1 + lengths.size() + (Huffman::streamCount - 1) * sizeof(std::uint64_t));
+            }
+        }
+        encoder.encodeStreams(block, payload);
+    }
+    else {
+        encoder.exportTree(payload);
+        encoder.encode(block, payload);
+    }
+    return std::move(payload).str();
+}
+
+// Read the input one block at a time.
+void HuffmanBlockEncoder::encode(std::istream& in, std::ostream& out)
+{
+    encode([&](Job& job)
+        {
+            job.input.resize(blockSize);
+            in.read(job.input.data(), blockSize);
+            job.data = {job.input.data(), static_cast<std::size_t>(in.gcount())};
+            return !job.data.empty();
+        },
+        out);
+}
+
+// The blocks are views of the input so nothing is copied.
+void HuffmanBlockEncoder::encode(std::span<char const> in, std::ostream& out)
+{
+    encode([&](Job& job)
+        {
+            job.data    = in.first(std::min(blockSize, in.size()));
+            in          = in.subspan(job.data.size());
+            return !job.data.empty();
+        },
+        out);
+}
+
+// read(Job&) sets the data of the job to the next block of input.
+// The output may not be seekable so we track the offsets as we write the blocks.
+template<typename Read>
+void HuffmanBlockEncoder::encode(Read&& read, std::ostream& out)
+{
+    std::vector<IndexEntry>     index;
+    std::uint64_t               compressedOffset    = fileHeaderSize;
+    std::uint64_t               uncompressedOffset  = 0;
+
+    out.write(marker, sizeof(marker));
+    writeValue(out, blockSize);
+
+    orderedParallel(threads,
+        read,
+        [&](Job& job)
+        {
+            job.output = encodeBlock(job.data);
+        },
+        [&](Job& job)
+        {
+            writeValue(out, job.data.size());
+            writeValue(out, job.output.size());
+            out.write(job.output.data(), job.output.size());
+            // When streaming the reader should see each block as soon as it is available.
+            out.flush();
+
+            index.push_back({compressedOffset, job.output.size(), uncompressedOffset, job.data.size()});
+            compressedOffset    += blockHeaderSize + job.output.size();
+            uncompressedOffset  += job.data.size();
+            return true;
+        });
+
+    // Mark the end of the blocks.
+    writeValue(out, 0);
+    writeValue(out, 0);
+    compressedOffset += blockHeaderSize;
+
+    // The index and the footer that points at it.
+    for (auto const& entry: index) {
+        writeValue(out, entry.compressedOffset);
+        writeValue(out, entry.compressedSize);
+        writeValue(out, entry.uncompressedOffset);
+        writeValue(out, entry.uncompressedSize);
+    }
+    writeValue(out, compressedOffset);
+    writeValue(out, index.size());
+    out.write(indexMarker, sizeof(indexMarker));
+
+    if (stats) {
+        stats->addHeader(fileHeaderSize + (index.size() + 1) * blockHeaderSize + index.size() * sizeof(IndexEntry) + footerSize);
+    }
+}
+
+HuffmanBlockDecoder::HuffmanBlockDecoder(std::size_t threads)
+    : threads(threadCount(threads))
+{}
+
+// Check if the stream (positioned at the start of a .huf file) uses the block format.
+// The other formats start with a tree ('N', 'C', 'Z') or a code length table ('L').
+bool HuffmanBlockDecoder::isBlockFormat(std::istream& in)
+{
+    return in.peek() == marker[0];
+}
+
+// Decode all the blocks in the input stream one after the other.
+bool HuffmanBlockDecoder::decode(std::istream& in, std::ostream& out)
+{
+    if (!readHeader(in)) {
+        return false;
+    }
+
+    std::string         output;
+    while (readBlock(in, output)) {
+        if (output.empty()) {
+            return true;
+        }
+        out.write(output.data(), output.size());
+    }
+    return false;
+}
+
+bool HuffmanBlockDecoder::readHeader(std::istream& in)
+{
+    char            fileMarker[sizeof(marker)];
+    if (!in.read(fileMarker, sizeof(fileMarker)) || !std::equal(std::begin(marker), std::end(marker), fileMarker)) {
+        return false;
+    }
+    return readValue(in, blockSize) && blockSize != 0;
+}
+
+// The end of the blocks is marked by a block with an uncompressed size of zero.
+bool HuffmanBlockDecoder::readBlock(std::istream& in, std::string& output)
+{
+    std::uint64_t   size;
+    std::uint64_t   compressed;
+    if (!readValue(in, size) || !readValue(in, compressed)) {
+        return false;
+    }
+    if (size == 0) {
+        output.clear();
+        return true;
+    }
+    if (size > blockSize || compressed > maxPayloadSize(size)) {
+        return false;
+    }
+    payload.resize(compressed);
+    return in.read(payload.data(), compressed) && decodeBlock(payload, output, size);
+}
+
+// Read the index from the end of the stream.
+// If there is no valid index the stream is returned to its original position.
+bool HuffmanBlockDecoder::readIndex(std::istream& in)
+{
+    std::istream::pos_type  start = in.tellg();
+    if (start == std::istream::pos_type(-1)) {
+        in.clear();
+        return false;
+    }
+
+    auto readIndexData = [&]()
+    {
+        char            fileMarker[sizeof(marker)];
+        in.seekg(0);
+        if (!in.read(fileMarker, sizeof(fileMarker)) || !std::equal(std::begin(marker), std::end(marker), fileMarker)) {
+            return false;
+        }
+        if (!readValue(in, blockSize) || blockSize == 0) {
+            return false;
+        }
+
+        in.seekg(0, std::ios_base::end);
+        std::uint64_t   fileSize = in.tellg();
+        if (!in || fileSize < fileHeaderSize + blockHeaderSize + footerSize) {
+            return false;
+        }
+
+        std::uint64_t   indexOffset;
+        std::uint64_t   count;
+        char            footerMarker[sizeof(indexMarker)];
+        in.seekg(fileSize - footerSize);
+        if (!readValue(in, indexOffset) || !readValue(in, count) || !in.read(footerMarker, sizeof(footerMarker))) {
+            return false;
+        }
+        if (!std::equal(std::begin(indexMarker), std::end(indexMarker), footerMarker)) {
+            return false;
+        }
+        if (count > fileSize / sizeof(IndexEntry) || indexOffset + count * sizeof(IndexEntry) + footerSize != fileSize) {
+            return false;
+        }
+
+        // Each block must follow the previous block in both files.
+        index.resize(count);
+        in.seekg(indexOffset);
+        std::uint64_t   compressedOffset    = fileHeaderSize;
+        std::uint64_t   uncompressedOffset  = 0;
+        for (auto& entry: index) {
+            if (!readValue(in, entry.compressedOffset) || !readValue(in, entry.compressedSize) || !readValue(in, entry.uncompressedOffset) || !readValue(in, entry.uncompressedSize)) {
+                return false;
+            }
+            if (entry.compressedOffset != compressedOffset || entry.uncompressedOffset != uncompressedOffset) {
+                return false;
+            }
+            if (entry.uncompressedSize == 0 || entry.uncompressedSize > blockSize || entry.compressedSize > maxPayloadSize(entry.uncompressedSize)) {
+                return false;
+            }
+            compressedOffset    += blockHeaderSize + entry.compressedSize;
+            uncompressedOffset  += entry.uncompressedSize;
+        }
+        return compressedOffset + blockHeaderSize == indexOffset;
+    };
+
+    if (!readIndexData()) {
+        index.clear();
+        in.clear();
+        in.seekg(start);
+        return false;
+    }
+    return true;
+}
+
+bool HuffmanBlockDecoder::readIndex(std::span<char const> file)
+{
+    MemoryInputBuf  buffer(file);
+    std::istream    in(&buffer);
+    return readIndex(in);
+}
+
+std::uint64_t HuffmanBlockDecoder::size() const
+{
+    return index.empty() ? 0 : index.back().uncompressedOffset + index.back().uncompressedSize;
+}
+
+// Decode all the blocks using worker threads.
+bool HuffmanBlockDecoder::decodeParallel(std::istream& in, std::ostream& out)
+{
+    return decodeRange(in, out, 0, size());
+}
+
+bool HuffmanBlockDecoder::decodeParallel(std::span<char const> file, std::ostream& out)
+{
+    return decodeRange(file, out, 0, size());
+}
+
+// Decode the bytes [offset, offset + length) of the original file.
+bool HuffmanBlockDecoder::decodeRange(std::istream& in, std::ostream& out, std::uint64_t offset, std::uint64_t length)
+{
+    in.clear();
+    return decodeRange([&](IndexEntry const& entry, Job& job)
+        {
+            job.input.resize(entry.compressedSize);
+            in.seekg(entry.compressedOffset + blockHeaderSize);
+            job.data = job.input;
+            return static_cast<bool>(in.read(job.input.data(), job.input.size()));
+        },
+        out, offset, length);
+}
+
+// The blocks are views of the file so nothing is copied.
+bool HuffmanBlockDecoder::decodeRange(std::span<char const> file, std::ostream& out, std::uint64_t offset, std::uint64_t length)
+{
+    return decodeRange([&](IndexEntry const& entry, Job& job)
+        {
+            if (entry.compressedOffset + blockHeaderSize + entry.compressedSize > file.size()) {
+                return false;
+            }
+            job.data = file.subspan(entry.compressedOffset + blockHeaderSize, entry.compressedSize);
+            return true;
+        },
+        out, offset, length);
+}
+
+// fetch(IndexEntry const&, Job&) sets the data of the job to the payload of the block.
+// The compressed blocks are fetched in order (by the reader thread of orderedParallel()) and
+// the calling thread writes the part of each decompressed block that is in the range.
+template<typename Fetch>
+bool HuffmanBlockDecoder::decodeRange(Fetch&& fetch, std::ostream& out, std::uint64_t offset, std::uint64_t length)
+{
+    if (offset > size()) {
+        return false;
+    }
+    std::uint64_t   end     = offset + std::min(length, size() - offset);
+
+    // The first block that contains 'offset'.
+    auto            first   = std::upper_bound(std::begin(index), std::end(index), offset, [](std::uint64_t value, IndexEntry const& entry){return value < entry.uncompressedOffset;});
+    std::size_t     next    = std::max(first - std::begin(index), std::ptrdiff_t{1}) - 1;
+    bool            result  = true;
+
+    orderedParallel(threads,
+        [&](Job& job)
+        {
+            if (next == index.size() || index[next].uncompressedOffset >= end) {
+                return false;
+            }
+            job.id      = next++;
+            job.ok      = fetch(index[job.id], job);
+            return true;
+        },
+        [&](Job& job)
+        {
+            job.ok      = job.ok && decodeBlock(job.data, job.output, index[job.id].uncompressedSize);
+        },
+        [&](Job& job)
+        {
+            if (!job.ok) {
+                result = false;
+                return false;
+            }
+            IndexEntry const&   entry   = index[job.id];
+            std::uint64_t       from    = std::max(offset, entry.uncompressedOffset) - entry.uncompressedOffset;
+            std::uint64_t       to      = std::min(end, entry.uncompressedOffset + entry.uncompressedSize) - entry.uncompressedOffset;
+            out.write(job.output.data() + from, to - from);
+            return true;
+        });
+    return result;
+}
+
+// Decode a block that is expected to decompress to 'size' bytes into output.
+bool HuffmanBlockDecoder::decodeBlock(std::span<char const> payload, std::string& output, std::size_t size) const
+{
+    if (!payload.empty() && payload[0] == stored) {
+        if (payload.size() != 1 + size) {
+            return false;
+        }
+        output.assign(std::begin(payload) + 1, std::end(payload));
+        return true;
+    }
+    if (!payload.empty() && payload[0] == runLength) {
+        if (payload.size() != 2) {
+            return false;
+        }
+        output.assign(size, payload[1]);
+        return true;
+    }
+    if (!payload.empty() && payload[0] == lz) {
+        HuffmanStats::Timer timer(stats, HuffmanStats::Decode, size);
+        HuffmanLZDecoder    decoder;
+        output.resize(size + HuffmanLZ::copySlack);
+        bool                ok = decoder.decode(payload.subspan(1), output, size);
+        output.resize(size);
+        return ok;
+    }
+
+    Huffman::CodeLengths    lengths;
+    if (payload.size() < 1 + lengths.size() || (payload[0] != singleStream && payload[0] != multiStream)) {
+        return false;
+    }
+    std::copy(&payload[1], &payload[1] + lengths.size(), reinterpret_cast<char*>(lengths.data()));
+
+    HuffmanDecoder      decoder;
+    decoder.setStats(stats);
+    if (!decoder.buildTree(lengths)) {
+        return false;
+    }
+
+    std::span<char const>   data = payload.subspan(1 + lengths.size());
+    output.resize(size + HuffmanDecoder::maxLetters);
+    if (payload[0] == multiStream) {
+        bool                ok = decoder.decodeStreams(data, output, size);
+        output.resize(size);
+        return ok;
+    }
+
+    std::size_t         decoded;
+    bool                ok = decoder.decode(data, output, decoded);
+    output.resize(decoded);
+    return ok && decoded == size;
+}
@@ -0,0 +1,176 @@
+#ifndef THORSANVIL_PUZZLE_HUFFMAN_BLOCK_H
+#define THORSANVIL_PUZZLE_HUFFMAN_BLOCK_H
+
+#include "Huffman.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <span>
+#include <vector>
+
+
+namespace ThorsAnvil::Puzzle
+{
+
+// The block format splits the input into fixed size blocks.
+// Each block has its own canonical Huffman code so blocks are compressed
+// independently of each other (and adapt to the data in the block).
+// The index at the end of the file allows the blocks to be decompressed
+// in parallel or a range of the original file to be extracted without
+// decompressing the whole file.
+//
+//  File:
+//      "HUFB"              Marker
+//      std::uint64_t       Block size (the maximum size of an uncompressed block).
+//      Block*
+//      std::uint64_t 0     Uncompressed size of zero marks the end of the blocks.
+//      std::uint64_t 0
+//      IndexEntry*         One entry for each block.
+//      std::uint64_t       Offset of the index in the file.
+//      std::uint64_t       Number of entries in the index.
+//      "HUFI"              Marker
+//
+//  Block:
+//      std::uint64_t       Size of the uncompressed block.
+//      std::uint64_t       Size of the compressed block (the payload).
+//      Payload (one of):
+//          'L' CodeLengths     The canonical code (see HuffmanEncoder::exportTree()).
+//          std::uint64_t*      The encoded block (terminated by the EOF marker).
+//
+//          'M' CodeLengths     The canonical code.
+//          std::uint64_t*      The block encoded as interleaved streams (see HuffmanEncoder::encodeStreams()).
+//
+//          'D' HuffmanLZ       The block compressed with LZ77 and Huffman coding (see HuffmanLZEncoder::encode()).
+//
+//          'S' char*           The block stored as is (used when Huffman coding does not make it smaller).
+//
+//          'R' char            The block is this byte repeated (size of the uncompressed block) times.
+class HuffmanBlock
+{
+    public:
+        static constexpr char           marker[4]           = {'H', 'U', 'F', 'B'};
+        static constexpr char           indexMarker[4]      = {'H', 'U', 'F', 'I'};
+        static constexpr std::size_t    defaultBlockSize    = 1024 * 1024;
+        static constexpr std::size_t    fileHeaderSize      = sizeof(marker) + sizeof(std::uint64_t);
+        static constexpr std::size_t    blockHeaderSize     = 2 * sizeof(std::uint64_t);
+        static constexpr std::size_t    footerSize          = 2 * sizeof(std::uint64_t) + sizeof(indexMarker);
+
+        // How the encoder compresses the blocks.
+        //  Huffman:        A single Huffman coded stream.
+        //  Interleaved:    Huffman::streamCount interleaved Huffman coded streams.
+        //  LZ:             LZ77 followed by Huffman coding.
+        enum class Coding {Huffman, Interleaved, LZ};
+
+        // The first byte of the payload identifies how the block was encoded.
+        static constexpr char           singleStream        = 'L';
+        static constexpr char           multiStream         = 'M';
+        static constexpr char           lz                  = 'D';
+        static constexpr char           stored              = 'S';
+        static constexpr char           runLength           = 'R';
+
+        // The location of a block in the compressed and uncompressed files.
+        struct IndexEntry
+        {
+            std::uint64_t   compressedOffset;       // Offset of the block header in the compressed file.
+            std::uint64_t   compressedSize;         // Size of the payload.
+            std::uint64_t   uncompressedOffset;
+            std::uint64_t   uncompressedSize;
+        };
+
+        // The largest payload a block of 'size' bytes can generate.
+        static std::size_t maxPayloadSize(std::size_t size);
+};
+
+class HuffmanBlockEncoder: public HuffmanBlock
+{
+    private:
+        std::size_t     blockSize;
+        std::size_t     threads;
+        std::size_t     codeLengthLimit;
+        Coding          coding;
+        HuffmanStats*   stats       = nullptr;
+
+    public:
+        // If threads is zero then one thread per core is used.
+        // With LZ coding the block size is limited to HuffmanLZ::maxInputSize.
+        HuffmanBlockEncoder(std::size_t blockSize = defaultBlockSize, std::size_t threads = 0, std::size_t codeLengthLimit = Huffman::defaultMaxCodeLength, Coding coding = Coding::Huffman);
+
+        // Record the time spent in each phase (by all the worker threads) in stats.
+        void setStats(HuffmanStats* value)     {stats = value;}
+
+        // Read the input one block at a time.
+        // Each block is compressed by a worker thread and the compressed
+        // blocks are written to the output in the same order they were read.
+        void encode(std::istream& in, std::ostream& out);
+        void encode(std::span<char const> in, std::ostream& out);
+
+    private:
+        template<typename Read>
+        void encode(Read&& read, std::ostream& out);
+
+        std::string encodeBlock(std::span<char const> block) const;
+};
+
+class HuffmanBlockDecoder: public HuffmanBlock
+{
+    private:
+        std::size_t                 threads;
+        std::uint64_t               blockSize   = 0;
+        std::vector<IndexEntry>     index;
+        std::vector<char>           payload;    // Reused by readBlock().
+        HuffmanStats*               stats       = nullptr;
+
+    public:
+        // If threads is zero then one thread per core is used.
+        HuffmanBlockDecoder(std::size_t threads = 0);
+
+        // Record the time spent in each phase (by all the worker threads) in stats.
+        void setStats(HuffmanStats* value)     {stats = value;}
+
+        // Check if the stream (positioned at the start of a .huf file) uses the block format.
+        static bool isBlockFormat(std::istream& in);
+
+        // Decode all the blocks in the input stream one after the other.
+        // This does not use the index so works on streams that can not seek.
+        // Returns false if the input is not a valid block format stream.
+        bool decode(std::istream& in, std::ostream& out);
+
+        // Decode a stream one block at a time (so only one block is held in memory).
+        // readHeader() reads the file header then each call to readBlock() decodes the next block
+        // into output (output is empty after the last block).
+        // Both return false if the input is not a valid block format stream.
+        bool readHeader(std::istream& in);
+        bool readBlock(std::istream& in, std::string& output);
+
+        // Read the index from the end of the stream.
+        // If there is no valid index the stream is returned to its original position.
+        bool readIndex(std::istream& in);
+        bool readIndex(std::span<char const> file);
+
+        // Available after readIndex().
+        std::vector<IndexEntry> const& getIndex() const    {return index;}
+        std::uint64_t                   size() const;
+
+        // Decode all the blocks using worker threads.
+        // Requires the index (see readIndex()).
+        bool decodeParallel(std::istream& in, std::ostream& out);
+        bool decodeParallel(std::span<char const> file, std::ostream& out);
+
+        // Decode the bytes [offset, offset + length) of the original file.
+        // Only the blocks that contain the range are decompressed.
+        // Requires the index (see readIndex()).
+        bool decodeRange(std::istream& in, std::ostream& out, std::uint64_t offset, std::uint64_t length);
+        bool decodeRange(std::span<char const> file, std::ostream& out, std::uint64_t offset, std::uint64_t length);
+
+    private:
+        template<typename Fetch>
+        bool decodeRange(Fetch&& fetch, std::ostream& out, std::uint64_t offset, std::uint64_t length);
+
+        bool decodeBlock(std::span<char const> payload, std::string& output, std::size_t size) const;
+};
+
+}
+
+#endif
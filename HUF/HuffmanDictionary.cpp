@@ -0,0 +1,128 @@
+#include "HuffmanDictionary.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include <deque>
+
+
+using namespace ThorsAnvil::Puzzle;
+
+namespace
+{
+    // The code lengths of the compiled in dictionaries.
+    // Generated with: huf --train=text.dict --dictionary-id=1 --builtin test/test.txt
+    constexpr Huffman::CodeLengths textLengths = {
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  6, 15, 15,  6, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+         3, 10, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  6, 10,  7, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 10,  9, 15, 15, 15, 10,
+        15,  9, 10, 10, 11, 10, 10, 10,  9,  9, 12, 15, 14,  9, 10, 10,
+        10, 15, 10, 10,  8, 15, 15, 10, 15, 15, 15, 15, 15, 15, 15, 15,
+        15,  4,  7,  6,  5,  3,  6,  6,  4,  4, 10,  8,  5,  6,  4,  4,
+         6, 15,  5,  5,  4,  6,  7,  6, 10,  7, 15, 15, 15, 15, 15, 15,
+         7, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 10, 15, 15, 15, 15, 10, 15, 15,  9,  9, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15,  7, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15
+    };
+
+    HuffmanDictionary const builtins[] = {
+        {HuffmanDictionary::textId, textLengths},
+    };
+
+    // A deque so registering a dictionary does not move the others (see find()).
+    std::deque<HuffmanDictionary>& registered()
+    {
+        static std::deque<HuffmanDictionary>   dictionaries;
+        return dictionaries;
+    }
+}
+
+HuffmanDictionary::HuffmanDictionary(std::uint32_t id, Huffman::CodeLengths const& lengths)
+    : id(id)
+    , lengths(lengths)
+{}
+
+// Every byte value gets a code: one is added to each count so the bytes that were not
+// in the samples get the longest codes (the relative frequency of the rest is unchanged).
+HuffmanDictionary HuffmanDictionary::train(std::uint32_t id, Huffman::Histogram const& counts, std::size_t codeLengthLimit)
+{
+    Huffman::Histogram  smoothed;
+    std::transform(std::begin(counts), std::end(counts), std::begin(smoothed), [](std::uint64_t count){return count + 1;});
+
+    HuffmanEncoder      encoder(true, codeLengthLimit);
+    encoder.buildTree(smoothed);
+    return {id, encoder.codeLengths()};
+}
+
+bool HuffmanDictionary::load(std::istream& in)
+{
+    char            marker[sizeof(fileMarker)];
+    if (!in.read(marker, sizeof(marker)) || !std::equal(std::begin(fileMarker), std::end(fileMarker), marker)) {
+        return false;
+    }
+    if (!in.read(reinterpret_cast<char*>(&id), sizeof(id)) || !in.read(reinterpret_cast<char*>(lengths.data()), lengths.size())) {
+        return false;
+    }
+    return valid();
+}
+
+void HuffmanDictionary::save(std::ostream& out) const
+{
+    out.write(fileMarker, sizeof(fileMarker));
+    out.write(reinterpret_cast<char const*>(&id), sizeof(id));
+    out.write(reinterpret_cast<char const*>(lengths.data()), lengths.size());
+}
+
+// A dictionary registered with the id of an existing one replaces it.
+// The compiled in dictionaries can not be replaced.
+bool HuffmanDictionary::add(HuffmanDictionary const& dictionary)
+{
+    if (std::any_of(std::begin(builtins), std::end(builtins), [&](auto const& item){return item.id == dictionary.id;})) {
+        return false;
+    }
+    std::deque<HuffmanDictionary>& dictionaries = registered();
+    auto find = std::find_if(std::begin(dictionaries), std::end(dictionaries), [&](auto const& item){return item.id == dictionary.id;});
+    if (find != std::end(dictionaries)) {
+        *find = dictionary;
+    }
+    else {
+        dictionaries.emplace_back(dictionary);
+    }
+    return true;
+}
+
+HuffmanDictionary const* HuffmanDictionary::find(std::uint32_t id)
+{
+    for (auto const& dictionary: registered()) {
+        if (dictionary.id == id) {
+            return &dictionary;
+        }
+    }
+    for (auto const& dictionary: builtins) {
+        if (dictionary.id == id) {
+            return &dictionary;
+        }
+    }
+    return nullptr;
+}
+
+// The sum of 2^-length over all the codes is exactly one for a complete code.
+bool HuffmanDictionary::valid() const
+{
+    std::uint64_t   kraft = 0;
+    for (auto length: lengths) {
+        if (length == 0 || length > Huffman::maxCodeLength) {
+            return false;
+        }
+        kraft += std::uint64_t{1} << (Huffman::maxCodeLength - length);
+    }
+    return kraft == (std::uint64_t{1} << Huffman::maxCodeLength);
+}
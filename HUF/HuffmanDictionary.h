@@ -0,0 +1,75 @@
+#ifndef THORSANVIL_PUZZLE_HUFFMAN_DICTIONARY_H
+#define THORSANVIL_PUZZLE_HUFFMAN_DICTIONARY_H
+
+#include "Huffman.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+
+namespace ThorsAnvil::Puzzle
+{
+
+// A canonical code trained offline from sample data.
+// Small messages encoded with a dictionary skip the histogram pass and the tree build, and the
+// header is the id of the dictionary rather than the code (see HuffmanEncoder::useDictionary()).
+// Every byte value has a code so any input can be encoded (bytes not in the samples get long codes).
+//
+//  Dictionary file:
+//      "HUFD"              Marker
+//      std::uint32_t       Id
+//      CodeLengths         The length of the code for each symbol.
+//
+//  Encoded data:
+//      'T'                 Marker
+//      std::uint32_t       Id of the dictionary.
+//      std::uint64_t*      The encoded data (terminated by the EOF marker).
+class HuffmanDictionary
+{
+    public:
+        static constexpr char           fileMarker[4]   = {'H', 'U', 'F', 'D'};
+        static constexpr char           marker          = 'T';
+        static constexpr std::size_t    headerSize      = 1 + sizeof(std::uint32_t);
+
+        // The compiled in dictionaries.
+        // Ids below firstUserId are reserved for them.
+        static constexpr std::uint32_t  textId          = 1;        // English text (trained on test/test.txt).
+        static constexpr std::uint32_t  firstUserId     = 256;
+
+    private:
+        std::uint32_t           id          = 0;
+        Huffman::CodeLengths    lengths{};
+
+    public:
+        HuffmanDictionary() = default;
+        HuffmanDictionary(std::uint32_t id, Huffman::CodeLengths const& lengths);
+
+        // Build a dictionary from a histogram of the sample data.
+        // The codes are no longer than codeLengthLimit bits.
+        static HuffmanDictionary train(std::uint32_t id, Huffman::Histogram const& counts, std::size_t codeLengthLimit = Huffman::defaultMaxCodeLength);
+
+        // Read (write) a dictionary file.
+        // load() returns false if the file is not a valid dictionary.
+        bool load(std::istream& in);
+        void save(std::ostream& out) const;
+
+        // The dictionaries the decoder can use: the compiled in ones plus any that have been registered.
+        // Note: Not thread safe. Dictionaries should be registered before any decoding starts.
+        // add() returns false (and does not register the dictionary) if the id is used by a compiled in dictionary.
+        // find() returns nullptr if there is no dictionary with the id.
+        // The pointer stays valid when more dictionaries are registered (a dictionary registered
+        // again with the same id replaces the one it points at).
+        static bool                         add(HuffmanDictionary const& dictionary);
+        static HuffmanDictionary const*     find(std::uint32_t id);
+
+        std::uint32_t                   getId() const           {return id;}
+        Huffman::CodeLengths const&     codeLengths() const     {return lengths;}
+
+        // True if every byte value (and the EOF marker) has a code and the code is complete.
+        bool                            valid() const;
+};
+
+}
+
+#endif
@@ -0,0 +1,378 @@
+#include "HuffmanIO.h"
+
+#include <cstddef>
+#include <cerrno>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+using namespace ThorsAnvil::Puzzle;
+
+MappedFile::MappedFile(std::string const& fileName)
+{
+    fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    struct stat     info;
+    if (::fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        return;
+    }
+    size = info.st_size;
+    if (size == 0) {
+        // Can not map an empty file.
+        // Note: Some special files (like /proc) report a size of zero so let the caller use a stream.
+        return;
+    }
+
+    void* map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        size = 0;
+        return;
+    }
+    ::madvise(map, size, MADV_SEQUENTIAL);
+    ::madvise(map, size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    ::madvise(map, size, MADV_HUGEPAGE);
+#endif
+    data    = static_cast<char const*>(map);
+    open    = true;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data != nullptr) {
+        ::munmap(const_cast<char*>(data), size);
+    }
+    if (fd != -1) {
+        ::close(fd);
+    }
+}
+
+MemoryInputBuf::MemoryInputBuf(std::span<char const> data)
+{
+    // The get area is never written to.
+    char* begin = const_cast<char*>(data.data());
+    setg(begin, begin, begin + data.size());
+}
+
+MemoryInputBuf::pos_type MemoryInputBuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+    if (!(which & std::ios_base::in)) {
+        return pos_type(off_type(-1));
+    }
+    off_type    base    = dir == std::ios_base::beg ? 0
+                        : dir == std::ios_base::cur ? gptr() - eback()
+                        :                             egptr() - eback();
+    off_type    pos     = base + off;
+    if (pos < 0 || pos > egptr() - eback()) {
+        return pos_type(off_type(-1));
+    }
+    setg(eback(), eback() + pos, egptr());
+    return pos_type(pos);
+}
+
+MemoryInputBuf::pos_type MemoryInputBuf::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+BufferQueue::BufferQueue(std::size_t count, std::size_t size)
+    : buffers(count, std::vector<char>(size))
+    , sizes(count)
+{}
+
+// Wait for an empty buffer.
+// Returns an empty span if the consumer has cancelled the queue.
+std::span<char> BufferQueue::acquire()
+{
+    std::size_t     head    = published.load(std::memory_order_relaxed);
+    std::size_t     tail    = released.load(std::memory_order_acquire);
+    while (head - tail == buffers.size()) {
+        released.wait(tail, std::memory_order_acquire);
+        tail = released.load(std::memory_order_acquire);
+    }
+    if (cancelled.load(std::memory_order_acquire)) {
+        return {};
+    }
+    return buffers[head % buffers.size()];
+}
+
+// Pass the buffer returned by acquire() to the consumer.
+void BufferQueue::publish(std::size_t size)
+{
+    std::size_t     head    = published.load(std::memory_order_relaxed);
+    sizes[head % buffers.size()] = size;
+    published.store(head + 1, std::memory_order_release);
+    published.notify_one();
+}
+
+// The end of the data is marked by a buffer with a special size.
+void BufferQueue::close()
+{
+    if (!acquire().empty()) {
+        publish(endMarker);
+    }
+}
+
+// Wait for the next full buffer.
+// Returns an empty span once the queue is closed.
+std::span<char const> BufferQueue::front()
+{
+    std::size_t     tail    = released.load(std::memory_order_relaxed);
+    std::size_t     head    = published.load(std::memory_order_acquire);
+    while (head == tail) {
+        published.wait(head, std::memory_order_acquire);
+        head = published.load(std::memory_order_acquire);
+    }
+    std::size_t     size    = sizes[tail % buffers.size()];
+    if (size == endMarker) {
+        return {};
+    }
+    return {buffers[tail % buffers.size()].data(), size};
+}
+
+// Give the buffer returned by front() back to the producer.
+void BufferQueue::release()
+{
+    released.fetch_add(1, std::memory_order_release);
+    released.notify_one();
+}
+
+// Tell the producer to stop.
+// Moving the released counter wakes the producer if it is waiting for a buffer.
+void BufferQueue::cancel()
+{
+    cancelled.store(true, std::memory_order_release);
+    release();
+}
+
+AsyncInputBuf::AsyncInputBuf(int fd)
+    : queue(bufferCount, bufferSize)
+{
+    if (::pipe(stopPipe) != 0) {
+        stopPipe[0] = stopPipe[1] = -1;
+    }
+    reader = std::thread(&AsyncInputBuf::readBuffers, this, fd);
+}
+
+AsyncInputBuf::~AsyncInputBuf()
+{
+    stopping = true;
+    queue.cancel();
+    if (stopPipe[1] != -1) {
+        char    stop = 0;
+        if (::write(stopPipe[1], &stop, 1) != 1) {
+            // waitForInput() still sees stopping (without the pipe it checks every 100ms).
+        }
+    }
+    reader.join();
+    for (int end: stopPipe) {
+        if (end != -1) {
+            ::close(end);
+        }
+    }
+}
+
+void AsyncInputBuf::readBuffers(int fd)
+{
+    while (true) {
+        std::span<char>     buffer  = queue.acquire();
+        if (buffer.empty() || !waitForInput(fd)) {
+            return;
+        }
+        ssize_t             size    = ::read(fd, buffer.data(), buffer.size());
+        if (size == -1 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            break;
+        }
+        queue.publish(size);
+    }
+    queue.close();
+}
+
+// Wait until fd can be read.
+// Returns false if the stream is being destroyed.
+bool AsyncInputBuf::waitForInput(int fd)
+{
+    pollfd  fds[2]  = {{fd, POLLIN, 0}, {stopPipe[0], POLLIN, 0}};
+    int     timeout = stopPipe[0] == -1 ? 100 : -1;
+    while (!stopping) {
+        int     ready = ::poll(fds, 2, timeout);
+        if (ready > 0 || (ready == -1 && errno != EINTR)) {
+            // An error on fd is reported by read().
+            return fds[1].revents == 0;
+        }
+    }
+    return false;
+}
+
+AsyncInputBuf::int_type AsyncInputBuf::underflow()
+{
+    if (holding) {
+        queue.release();
+        holding = false;
+    }
+    std::span<char const>   buffer = queue.front();
+    if (buffer.empty()) {
+        setg(nullptr, nullptr, nullptr);
+        return traits_type::eof();
+    }
+    holding = true;
+    count   += buffer.size();
+    // The get area is never written to.
+    char*   begin = const_cast<char*>(buffer.data());
+    setg(begin, begin, begin + buffer.size());
+    return traits_type::to_int_type(*gptr());
+}
+
+FileOutputBuf::FileOutputBuf(int fd, bool owner)
+    : fd(fd)
+    , owner(owner)
+    , queue(bufferCount, bufferSize)
+    , writer(&FileOutputBuf::writeBuffers, this)
+{
+    std::span<char>     buffer = queue.acquire();
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+FileOutputBuf::~FileOutputBuf()
+{
+    close();
+}
+
+bool FileOutputBuf::close()
+{
+    if (!closed) {
+        submit();
+        queue.close();
+        writer.join();
+        setp(nullptr, nullptr);
+        if (owner && fd != -1 && ::close(fd) != 0) {
+            failed = true;
+        }
+        closed = true;
+    }
+    return fd != -1 && !failed;
+}
+
+// The writer thread.
+// After an error the data is dropped (but the buffers still go back to the producer).
+void FileOutputBuf::writeBuffers()
+{
+    for (std::span<char const> buffer = queue.front(); !buffer.empty(); buffer = queue.front()) {
+        if (!failed && !writeAll(buffer.data(), buffer.size())) {
+            failed = true;
+        }
+        queue.release();
+    }
+}
+
+bool FileOutputBuf::writeAll(char const* data, std::size_t size)
+{
+    while (size != 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Pass the current buffer to the writer thread and start filling the next one.
+void FileOutputBuf::submit()
+{
+    if (pptr() == pbase()) {
+        return;
+    }
+    submitted += pptr() - pbase();
+    queue.publish(pptr() - pbase());
+    std::span<char>     buffer = queue.acquire();
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+FileOutputBuf::int_type FileOutputBuf::overflow(int_type c)
+{
+    if (closed || failed) {
+        return traits_type::eof();
+    }
+    submit();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize FileOutputBuf::xsputn(char const* s, std::streamsize n)
+{
+    std::streamsize     left = n;
+    while (left != 0) {
+        if (closed || failed) {
+            return n - left;
+        }
+        std::streamsize     size = std::min(left, static_cast<std::streamsize>(epptr() - pptr()));
+        std::copy(s, s + size, pptr());
+        pbump(size);
+        s       += size;
+        left    -= size;
+        if (pptr() == epptr()) {
+            submit();
+        }
+    }
+    return n;
+}
+
+int FileOutputBuf::sync()
+{
+    if (closed) {
+        return fd == -1 || failed ? -1 : 0;
+    }
+    submit();
+    return fd == -1 || failed ? -1 : 0;
+}
+
+OutputFile::OutputFile(std::string const& fileName)
+    : std::ostream(nullptr)
+    , buffer(::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666), true)
+{
+    rdbuf(&buffer);
+    if (buffer.pubsync() != 0) {
+        setstate(std::ios_base::failbit);
+    }
+}
+
+OutputFile::OutputFile(int fd)
+    : std::ostream(nullptr)
+    , buffer(fd, false)
+{
+    rdbuf(&buffer);
+}
+
+OutputFile::~OutputFile()
+{
+    flush();
+}
+
+bool OutputFile::close()
+{
+    flush();
+    if (!buffer.close()) {
+        setstate(std::ios_base::badbit);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,192 @@
+#ifndef THORSANVIL_PUZZLE_HUFFMAN_IO_H
+#define THORSANVIL_PUZZLE_HUFFMAN_IO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ios>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <span>
+#include <vector>
+#include <atomic>
+#include <thread>
+
+
+namespace ThorsAnvil::Puzzle
+{
+
+// A read only memory mapping of a regular file.
+// The kernel is told the file will be read sequentially so it can read ahead aggressively
+// and asked to use huge pages where it can.
+// If the file can not be mapped (it does not exist, is not a regular file or is empty) isOpen() returns false.
+class MappedFile
+{
+    private:
+        int             fd      = -1;
+        char const*     data    = nullptr;
+        std::size_t     size    = 0;
+        bool            open    = false;
+
+    public:
+        MappedFile(std::string const& fileName);
+        ~MappedFile();
+
+        MappedFile(MappedFile const&)               = delete;
+        MappedFile& operator=(MappedFile const&)    = delete;
+
+        bool                    isOpen() const  {return open;}
+        std::span<char const>   span() const    {return {data, size};}
+};
+
+// A stream buffer that reads directly from a block of memory.
+// This allows the stream based functions to be used on a MappedFile without copying.
+class MemoryInputBuf: public std::streambuf
+{
+    public:
+        MemoryInputBuf(std::span<char const> data);
+
+    protected:
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+};
+
+// A fixed set of buffers passed from one thread (the producer) to another (the consumer) and back again.
+// The buffers go round in a ring so nothing is allocated once the queue is built.
+// The two sides only share a pair of counters (no locks); a side that has to wait
+// for the other blocks on the counter (std::atomic::wait()).
+class BufferQueue
+{
+    private:
+        static constexpr std::size_t endMarker = static_cast<std::size_t>(-1);
+
+        std::vector<std::vector<char>>          buffers;
+        std::vector<std::size_t>                sizes;
+        alignas(64) std::atomic<std::size_t>    published{0};
+        alignas(64) std::atomic<std::size_t>    released{0};
+        std::atomic<bool>                       cancelled{false};
+
+    public:
+        BufferQueue(std::size_t count, std::size_t size);
+
+        // Producer:
+        // Wait for an empty buffer (returns an empty span if the consumer has cancelled the queue).
+        // Pass it (with 'size' bytes filled in) to the consumer.
+        // Tell the consumer there are no more buffers.
+        std::span<char>         acquire();
+        void                    publish(std::size_t size);
+        void                    close();
+
+        // Consumer:
+        // Wait for the next full buffer (returns an empty span once the queue is closed).
+        // Give it back to the producer.
+        // Tell the producer to stop.
+        std::span<char const>   front();
+        void                    release();
+        void                    cancel();
+};
+
+// A stream buffer that reads from a file descriptor (like a pipe) on a background thread.
+// The reader thread keeps the buffers of a BufferQueue full so reading overlaps with
+// the work done on the data. The stream can not seek.
+// The destructor stops the reader thread (even if it is waiting on a pipe) and joins it.
+class AsyncInputBuf: public std::streambuf
+{
+    public:
+        static constexpr std::size_t bufferSize     = 1024 * 1024;
+        static constexpr std::size_t bufferCount    = 4;
+
+    private:
+        BufferQueue                     queue;
+        // Writing to stopPipe wakes the reader thread when the stream is destroyed.
+        int                             stopPipe[2] = {-1, -1};
+        std::atomic<bool>               stopping{false};
+        bool                            holding     = false;
+        std::uint64_t                   count       = 0;
+        std::thread                     reader;
+
+    public:
+        AsyncInputBuf(int fd);
+        ~AsyncInputBuf();
+
+        AsyncInputBuf(AsyncInputBuf const&)             = delete;
+        AsyncInputBuf& operator=(AsyncInputBuf const&)  = delete;
+
+        // The number of bytes passed to the stream so far.
+        std::uint64_t   size() const    {return count;}
+
+    protected:
+        int_type        underflow() override;
+
+    private:
+        void            readBuffers(int fd);
+        bool            waitForInput(int fd);
+};
+
+// A stream buffer that writes to a file descriptor on a background thread.
+// Full buffers are passed to the writer thread through a BufferQueue so writing
+// overlaps with generating the next buffer.
+// sync() passes on the buffer without waiting for it to be written.
+// close() (or the destructor) waits for all the data to be written.
+// A failed write (disk full, a closed pipe) is reported by the next sync() or overflow() and by close().
+class FileOutputBuf: public std::streambuf
+{
+    public:
+        static constexpr std::size_t bufferSize     = 1024 * 1024;
+        static constexpr std::size_t bufferCount    = 4;
+
+    private:
+        int                 fd;
+        bool                owner;
+        BufferQueue         queue;
+        std::atomic<bool>   failed{false};
+        std::uint64_t       submitted   = 0;
+        bool                closed      = false;
+        std::thread         writer;
+
+    public:
+        FileOutputBuf(int fd, bool owner);
+        ~FileOutputBuf();
+
+        FileOutputBuf(FileOutputBuf const&)             = delete;
+        FileOutputBuf& operator=(FileOutputBuf const&)  = delete;
+
+        // The number of bytes written to the stream so far.
+        std::uint64_t   size() const    {return submitted + (pptr() - pbase());}
+
+        // Write all the data and stop the writer thread.
+        // Returns false if any of the data could not be written.
+        bool            close();
+
+    protected:
+        int_type        overflow(int_type c) override;
+        std::streamsize xsputn(char const* s, std::streamsize n) override;
+        int             sync() override;
+
+    private:
+        void            submit();
+        void            writeBuffers();
+        bool            writeAll(char const* data, std::size_t size);
+};
+
+// An output stream for a file (or an already open file descriptor like the standard output).
+class OutputFile: public std::ostream
+{
+    private:
+        FileOutputBuf   buffer;
+
+    public:
+        OutputFile(std::string const& fileName);
+        OutputFile(int fd);
+        ~OutputFile();
+
+        std::uint64_t   size() const    {return buffer.size();}
+
+        // Write all the data (see FileOutputBuf::close()).
+        // Returns false (and sets the badbit) if any of the data could not be written.
+        bool            close();
+};
+
+}
+
+#endif
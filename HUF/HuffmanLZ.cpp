@@ -0,0 +1,333 @@
+#include "HuffmanLZ.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <bit>
+
+
+using namespace ThorsAnvil::Puzzle;
+
+namespace
+{
+    std::uint32_t hash(char const* data, std::size_t hashBits)
+    {
+        std::uint32_t   value;
+        std::memcpy(&value, data, sizeof(value));
+        return (value * 2654435761U) >> (32 - hashBits);
+    }
+
+    // The number of bytes (up to maxLength) that are the same at l and r.
+    // Compare 8 bytes at a time: the first different bit gives the first different byte.
+    std::size_t matchLength(char const* l, char const* r, std::size_t maxLength)
+    {
+        std::size_t     length = 0;
+        for (; length + sizeof(std::uint64_t) <= maxLength; length += sizeof(std::uint64_t)) {
+            std::uint64_t   left;
+            std::uint64_t   right;
+            std::memcpy(&left,  l + length, sizeof(left));
+            std::memcpy(&right, r + length, sizeof(right));
+            std::uint64_t   diff = left ^ right;
+            if (diff != 0) {
+                int bits = std::endian::native == std::endian::little ? std::countr_zero(diff) : std::countl_zero(diff);
+                return length + bits / 8;
+            }
+        }
+        while (length < maxLength && l[length] == r[length]) {
+            ++length;
+        }
+        return length;
+    }
+
+    void writeValue(std::string& out, std::uint64_t value)
+    {
+        out.append(reinterpret_cast<char const*>(&value), sizeof(value));
+    }
+
+    bool readValue(std::span<char const>& in, std::uint64_t& value)
+    {
+        if (in.size() < sizeof(value)) {
+            return false;
+        }
+        std::memcpy(&value, in.data(), sizeof(value));
+        in = in.subspan(sizeof(value));
+        return true;
+    }
+
+    void writeVarint(std::vector<std::uint8_t>& out, std::uint64_t value)
+    {
+        while (value >= 0x80) {
+            out.push_back(static_cast<std::uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<std::uint8_t>(value));
+    }
+
+    bool readVarint(std::uint8_t const*& pos, std::uint8_t const* end, std::uint64_t& value)
+    {
+        value = 0;
+        for (std::size_t shift = 0; pos != end && shift < 64; shift += 7) {
+            std::uint8_t    byte = *pos++;
+            value |= std::uint64_t{byte & 0x7FU} << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Copy 'step' bytes at a time (so up to step - 1 bytes past the end are written).
+    // The source may overlap the destination as long as it is at least 'step' bytes before it.
+    template<std::size_t step>
+    void wildCopy(char* dst, char const* src, std::size_t length)
+    {
+        char* const     end = dst + length;
+        do {
+            std::memcpy(dst, src, step);
+            dst += step;
+            src += step;
+        }
+        while (dst < end);
+    }
+}
+
+HuffmanLZEncoder::HuffmanLZEncoder(std::size_t codeLengthLimit)
+    : head(std::size_t{1} << hashBits)
+    , chain(windowSize)
+    , encoder(true, codeLengthLimit)
+{}
+
+// Add the position to the hash chains.
+void HuffmanLZEncoder::insert(std::span<char const> in, std::size_t pos)
+{
+    std::uint32_t&  first = head[hash(in.data() + pos, hashBits)];
+    chain[pos % windowSize] = first;
+    first = pos + 1;
+}
+
+// Find the longest match for the bytes at pos.
+// Follow the hash chain (most recent first) for at most maxChain positions inside the window.
+HuffmanLZEncoder::Match HuffmanLZEncoder::find(std::span<char const> in, std::size_t pos) const
+{
+    Match           best;
+    if (pos + minMatch > in.size()) {
+        return best;
+    }
+
+    std::size_t     maxLength   = in.size() - pos;
+    std::uint32_t   candidate   = head[hash(in.data() + pos, hashBits)];
+    for (std::size_t attempts = maxChain; candidate != 0 && attempts != 0; --attempts) {
+        std::size_t     match = candidate - 1;
+        if (match >= pos || pos - match > windowSize) {
+            break;
+        }
+        // Only a match that is longer than the best one so far is interesting.
+        if (in[match + best.length] == in[pos + best.length]) {
+            std::size_t length = matchLength(in.data() + match, in.data() + pos, maxLength);
+            if (length > best.length) {
+                best = {length, pos - match};
+                if (length == maxLength) {
+                    break;
+                }
+            }
+        }
+        // Older entries in the chain may have been replaced by newer positions.
+        std::uint32_t   next = chain[match % windowSize];
+        if (next >= candidate) {
+            break;
+        }
+        candidate = next;
+    }
+    return best;
+}
+
+void HuffmanLZEncoder::addSequence(std::span<char const> literals, Match const& match)
+{
+    streams[Literals].insert(std::end(streams[Literals]), std::begin(literals), std::end(literals));
+    writeVarint(streams[LiteralLengths], literals.size());
+    writeVarint(streams[MatchLengths], match.length - minMatch);
+    writeVarint(streams[Distances], match.distance);
+}
+
+// Compress a stream with its own Huffman code.
+// If that does not make it smaller it is stored as is.
+void HuffmanLZEncoder::writeStream(Buffer const& stream, std::string& out)
+{
+    compressed.resize(encoder.maxCompressedSize(stream.size()));
+    std::size_t     size = encoder.compress(std::as_bytes(std::span(stream)), compressed);
+
+    writeValue(out, stream.size());
+    if (size == 0 || size >= stream.size()) {
+        writeValue(out, stream.size());
+        out.append(reinterpret_cast<char const*>(stream.data()), stream.size());
+    }
+    else {
+        writeValue(out, size);
+        out.append(reinterpret_cast<char const*>(compressed.data()), size);
+    }
+}
+
+// Compress the input and append it to out.
+// Lazy matching: Before using a match check if the next position has a longer match.
+// If it does the current byte is a literal and we use the longer match.
+void HuffmanLZEncoder::encode(std::span<char const> in, std::string& out)
+{
+    for (auto& stream: streams) {
+        stream.clear();
+    }
+    std::fill(std::begin(head), std::end(head), 0);
+
+    std::uint64_t   sequences       = 0;
+    std::size_t     literalStart    = 0;
+    std::size_t     pos             = 0;
+    while (pos + minMatch <= in.size()) {
+        Match   match = find(in, pos);
+        insert(in, pos);
+        if (match.length < minMatch) {
+            ++pos;
+            continue;
+        }
+        while (pos + 1 + minMatch <= in.size()) {
+            Match   next = find(in, pos + 1);
+            if (next.length <= match.length) {
+                break;
+            }
+            ++pos;
+            insert(in, pos);
+            match = next;
+        }
+
+        addSequence(in.subspan(literalStart, pos - literalStart), match);
+        ++sequences;
+
+        std::size_t     matchEnd = pos + match.length;
+        for (++pos; pos < matchEnd && pos + minMatch <= in.size(); ++pos) {
+            insert(in, pos);
+        }
+        pos             = matchEnd;
+        literalStart    = pos;
+    }
+    std::span<char const>   tail = in.subspan(literalStart);
+    streams[Literals].insert(std::end(streams[Literals]), std::begin(tail), std::end(tail));
+
+    writeValue(out, sequences);
+    for (auto const& stream: streams) {
+        writeStream(stream, out);
+    }
+}
+
+// Read a stream (decompressing it if needed).
+// The buffer has copySlack extra bytes so the literals can be copied in blocks.
+bool HuffmanLZDecoder::readStream(std::span<char const>& in, Buffer& stream, std::size_t maxSize, std::size_t& size)
+{
+    std::uint64_t   streamSize;
+    std::uint64_t   storedSize;
+    if (!readValue(in, streamSize) || !readValue(in, storedSize)) {
+        return false;
+    }
+    if (streamSize > maxSize || storedSize > streamSize || storedSize > in.size()) {
+        return false;
+    }
+
+    stream.resize(streamSize + copySlack);
+    if (storedSize == streamSize) {
+        std::copy(std::begin(in), std::begin(in) + storedSize, std::begin(stream));
+    }
+    else {
+        std::size_t     decoded;
+        if (!decoder.decompress(std::as_bytes(in.first(storedSize)), std::as_writable_bytes(std::span(stream).first(streamSize)), decoded) || decoded != streamSize) {
+            return false;
+        }
+    }
+    in      = in.subspan(storedSize);
+    size    = streamSize;
+    return true;
+}
+
+// Decode the output of HuffmanLZEncoder::encode().
+// Literals and matches are copied in blocks of 8 or 16 bytes (overwriting the bytes after them
+// which are filled in by the next sequence). Matches closer than 8 bytes repeat a short pattern;
+// any multiple of the distance is also a valid distance so once the pattern has been
+// written out to 8 bytes the rest of the match is copied in blocks as well.
+bool HuffmanLZDecoder::decode(std::span<char const> in, std::span<char> out, std::size_t size)
+{
+    std::uint64_t   sequences;
+    if (!readValue(in, sequences) || sequences > size / minMatch || out.size() < size + copySlack) {
+        return false;
+    }
+
+    // Each value in the length and distance streams is at most 10 bytes.
+    std::array<std::size_t, streamCount>    sizes;
+    for (std::size_t loop = 0; loop < streamCount; ++loop) {
+        std::size_t     maxSize = loop == Literals ? size : sequences * 10;
+        if (!readStream(in, streams[loop], maxSize, sizes[loop])) {
+            return false;
+        }
+    }
+    if (!in.empty()) {
+        return false;
+    }
+
+    char const*             literal         = reinterpret_cast<char const*>(streams[Literals].data());
+    char const* const       literalEnd      = literal + sizes[Literals];
+    std::uint8_t const*     literalLength   = streams[LiteralLengths].data();
+    std::uint8_t const*     matchLength     = streams[MatchLengths].data();
+    std::uint8_t const*     distance        = streams[Distances].data();
+    char* const             begin           = out.data();
+    char* const             end             = begin + size;
+    char*                   dst             = begin;
+
+    for (std::uint64_t loop = 0; loop < sequences; ++loop) {
+        std::uint64_t   literals;
+        std::uint64_t   length;
+        std::uint64_t   offset;
+        if (!readVarint(literalLength, streams[LiteralLengths].data() + sizes[LiteralLengths], literals)
+         || !readVarint(matchLength,   streams[MatchLengths].data()   + sizes[MatchLengths],   length)
+         || !readVarint(distance,      streams[Distances].data()      + sizes[Distances],      offset)) {
+            return false;
+        }
+
+        if (literals > static_cast<std::uint64_t>(literalEnd - literal) || literals > static_cast<std::uint64_t>(end - dst)) {
+            return false;
+        }
+        wildCopy<16>(dst, literal, literals);
+        dst     += literals;
+        literal += literals;
+
+        length  += minMatch;
+        if (offset == 0 || offset > static_cast<std::uint64_t>(dst - begin) || length > static_cast<std::uint64_t>(end - dst)) {
+            return false;
+        }
+        char const*     src = dst - offset;
+        if (offset >= 16) {
+            wildCopy<16>(dst, src, length);
+        }
+        else if (offset >= 8) {
+            wildCopy<8>(dst, src, length);
+        }
+        else {
+            std::size_t     pattern = offset;
+            while (pattern < 8) {
+                pattern += offset;
+            }
+            std::size_t     start   = std::min<std::size_t>(pattern, length);
+            for (std::size_t index = 0; index < start; ++index) {
+                dst[index] = src[index];
+            }
+            if (length > start) {
+                wildCopy<8>(dst + start, dst + start - pattern, length - start);
+            }
+        }
+        dst += length;
+    }
+
+    // The literals after the last sequence.
+    if (literalEnd - literal != end - dst) {
+        return false;
+    }
+    std::copy(literal, literalEnd, dst);
+    return true;
+}
@@ -0,0 +1,107 @@
+#ifndef THORSANVIL_PUZZLE_HUFFMAN_LZ_H
+#define THORSANVIL_PUZZLE_HUFFMAN_LZ_H
+
+#include "Huffman.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <span>
+#include <array>
+#include <vector>
+
+
+namespace ThorsAnvil::Puzzle
+{
+
+// An LZ77 stage in front of the Huffman coder.
+// The input is turned into a list of sequences:
+//      Sequence:   Copy 'literal length' bytes from the literals.
+//                  Then copy 'match length' bytes from 'distance' bytes back in the output.
+// The sequences are split into four streams of bytes (so each kind of data gets its own statistics)
+// and each stream is compressed with its own Huffman code (see HuffmanEncoder::compress()).
+//
+//  Format:
+//      std::uint64_t       Number of sequences.
+//      Stream * 4          Literals, literal lengths, match lengths, distances.
+//
+//  Stream:
+//      std::uint64_t       Size of the stream.
+//      std::uint64_t       Size of the stored stream (when this is the same as the size the stream is not compressed).
+//      char*               The stored stream.
+//
+// Lengths and distances are written as variable length integers (7 bits per byte, low bits first,
+// the top bit is set if there are more bytes). Literals after the last sequence finish the output.
+class HuffmanLZ
+{
+    public:
+        static constexpr std::size_t    minMatch        = 4;
+        static constexpr std::size_t    windowBits      = 18;
+        static constexpr std::size_t    windowSize      = std::size_t{1} << windowBits;
+        static constexpr std::size_t    streamCount     = 4;
+
+        // Positions in the input are held in 32 bits (plus one) so this is the largest input the encoder accepts.
+        static constexpr std::size_t    maxInputSize    = std::numeric_limits<std::uint32_t>::max();
+
+        // The decoder copies blocks of 16 bytes so it may write this many bytes past the end of the output.
+        static constexpr std::size_t    copySlack       = 16;
+
+    protected:
+        enum Stream {Literals, LiteralLengths, MatchLengths, Distances};
+        using Buffer    = std::vector<std::uint8_t>;
+};
+
+class HuffmanLZEncoder: public HuffmanLZ
+{
+    private:
+        static constexpr std::size_t    hashBits        = 16;
+        static constexpr std::size_t    maxChain        = 32;
+
+        struct Match
+        {
+            std::size_t     length      = 0;
+            std::size_t     distance    = 0;
+        };
+
+        // head[hash] is the most recent position (plus one) with that hash.
+        // chain[position % windowSize] is the previous position (plus one) with the same hash.
+        std::vector<std::uint32_t>          head;
+        std::vector<std::uint32_t>          chain;
+        std::array<Buffer, streamCount>     streams;
+        std::vector<std::byte>              compressed;
+        HuffmanEncoder                      encoder;
+
+    public:
+        HuffmanLZEncoder(std::size_t codeLengthLimit = Huffman::defaultMaxCodeLength);
+
+        // Compress the input and append it to out.
+        // The input must be no more than maxInputSize bytes.
+        // The encoder can be reused: each call starts with empty hash chains.
+        void encode(std::span<char const> in, std::string& out);
+
+    private:
+        void  insert(std::span<char const> in, std::size_t pos);
+        Match find(std::span<char const> in, std::size_t pos) const;
+        void  addSequence(std::span<char const> literals, Match const& match);
+        void  writeStream(Buffer const& stream, std::string& out);
+};
+
+class HuffmanLZDecoder: public HuffmanLZ
+{
+    private:
+        std::array<Buffer, streamCount>     streams;
+        HuffmanDecoder                      decoder;
+
+    public:
+        // Decode the output of HuffmanLZEncoder::encode() (that is expected to decode to 'size' bytes).
+        // Note: out must have room for copySlack bytes more than size.
+        bool decode(std::span<char const> in, std::span<char> out, std::size_t size);
+
+    private:
+        bool readStream(std::span<char const>& in, Buffer& stream, std::size_t maxSize, std::size_t& size);
+};
+
+}
+
+#endif
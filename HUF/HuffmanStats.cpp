@@ -0,0 +1,234 @@
+#include "HuffmanStats.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+
+#include <time.h>
+
+
+using namespace ThorsAnvil::Puzzle;
+
+namespace
+{
+    std::uint64_t wallNow()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::uint64_t cpuNow()
+    {
+        timespec    now;
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        return std::uint64_t(now.tv_sec) * 1'000'000'000 + now.tv_nsec;
+    }
+
+    double megaBytesPerSecond(std::uint64_t bytes, double seconds)
+    {
+        return seconds > 0 ? bytes / seconds / 1e6 : 0;
+    }
+
+    // Restore the format of a stream (flags, precision and fill) when it goes out of scope.
+    class FormatGuard
+    {
+        std::ostream&           out;
+        std::ios_base::fmtflags flags;
+        std::streamsize         precision;
+        char                    fill;
+
+        public:
+            FormatGuard(std::ostream& out)
+                : out(out)
+                , flags(out.flags())
+                , precision(out.precision())
+                , fill(out.fill())
+            {}
+            ~FormatGuard()
+            {
+                out.flags(flags);
+                out.precision(precision);
+                out.fill(fill);
+            }
+            FormatGuard(FormatGuard const&)             = delete;
+            FormatGuard& operator=(FormatGuard const&)  = delete;
+    };
+
+    void writeJsonString(std::ostream& out, std::string const& value)
+    {
+        out << '"';
+        for (char c: value) {
+            if (c == '"' || c == '\\') {
+                out << '\\' << c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20) {
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+            }
+            else {
+                out << c;
+            }
+        }
+        out << '"';
+    }
+}
+
+HuffmanStats::Timer::Timer(HuffmanStats* stats, Phase phase, std::uint64_t bytes)
+    : stats(stats)
+    , phase(phase)
+    , bytes(bytes)
+{
+    if (stats) {
+        wallStart   = wallNow();
+        cpuStart    = cpuNow();
+    }
+}
+
+HuffmanStats::Timer::~Timer()
+{
+    if (stats) {
+        stats->add(phase, bytes, wallNow() - wallStart, cpuNow() - cpuStart);
+    }
+}
+
+void HuffmanStats::add(Phase phase, std::uint64_t bytes, std::uint64_t wallNanos, std::uint64_t cpuNanos)
+{
+    PhaseCounters&  counters = phases[phase];
+    counters.calls.fetch_add(1, std::memory_order_relaxed);
+    counters.wallNanos.fetch_add(wallNanos, std::memory_order_relaxed);
+    counters.cpuNanos.fetch_add(cpuNanos, std::memory_order_relaxed);
+    counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void HuffmanStats::addHeader(std::uint64_t size)
+{
+    headerBytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+// The entropy of the symbols is: sum(count * -log2(count / total))
+void HuffmanStats::addCode(std::span<std::uint64_t const, Huffman::symbolCount> counts, std::span<Huffman::Code const, Huffman::symbolCount> codes)
+{
+    std::uint64_t   total   = 0;
+    std::uint64_t   bits    = 0;
+    std::uint64_t   longest = 0;
+    for (std::size_t symbol = 0; symbol < Huffman::symbolCount; ++symbol) {
+        if (counts[symbol] != 0) {
+            total   += counts[symbol];
+            bits    += counts[symbol] * codes[symbol].length;
+            longest = std::max(longest, codes[symbol].length);
+        }
+    }
+    double          entropy = 0;
+    for (auto count: counts) {
+        if (count != 0) {
+            entropy -= count * std::log2(static_cast<double>(count) / total);
+        }
+    }
+
+    symbols.fetch_add(total, std::memory_order_relaxed);
+    codedBits.fetch_add(bits, std::memory_order_relaxed);
+    entropyBits.fetch_add(entropy, std::memory_order_relaxed);
+    std::uint64_t   current = maxCodeLength.load(std::memory_order_relaxed);
+    while (current < longest && !maxCodeLength.compare_exchange_weak(current, longest, std::memory_order_relaxed)) {
+    }
+}
+
+// The CPU time is the sum over all the threads that worked on the file.
+// The code statistics are only available when compressing (and only cover the Huffman coded data).
+void HuffmanStats::report(std::ostream& out, File const& file, bool json) const
+{
+    FormatGuard     guard(out);
+    std::uint64_t   uncompressed    = file.action == '+' ? file.bytesIn : file.bytesOut;
+    std::uint64_t   compressed      = file.action == '+' ? file.bytesOut : file.bytesIn;
+    double          cpuSeconds      = 0;
+    for (auto const& counters: phases) {
+        cpuSeconds += counters.cpuNanos.load() / 1e9;
+    }
+    std::uint64_t   symbolCount     = symbols.load();
+    double          averageLength   = symbolCount != 0 ? static_cast<double>(codedBits.load()) / symbolCount : 0;
+    double          entropy         = symbolCount != 0 ? entropyBits.load() / symbolCount : 0;
+    double          achieved        = uncompressed != 0 ? compressed * 8.0 / uncompressed : 0;
+    char const*     action          = file.action == '+' ? "compress" : "decompress";
+
+    if (json) {
+        out << std::fixed << std::setprecision(6)
+            << "{\"file\":";
+        writeJsonString(out, file.name);
+        out << ",\"action\":\"" << action << "\""
+            << ",\"bytesIn\":" << file.bytesIn
+            << ",\"bytesOut\":" << file.bytesOut
+            << ",\"headerBytes\":" << headerBytes.load()
+            << ",\"wallSeconds\":" << file.wallSeconds
+            << ",\"cpuSeconds\":" << cpuSeconds
+            << ",\"throughputMBs\":" << megaBytesPerSecond(uncompressed, file.wallSeconds)
+            << ",\"phases\":{";
+        for (std::size_t phase = 0; phase < phaseCount; ++phase) {
+            PhaseCounters const&    counters    = phases[phase];
+            double                  wall        = counters.wallNanos.load() / 1e9;
+            out << (phase == 0 ? "" : ",")
+                << "\"" << phaseNames[phase] << "\":{"
+                << "\"calls\":" << counters.calls.load()
+                << ",\"wallSeconds\":" << wall
+                << ",\"cpuSeconds\":" << counters.cpuNanos.load() / 1e9
+                << ",\"bytes\":" << counters.bytes.load()
+                << ",\"throughputMBs\":" << megaBytesPerSecond(counters.bytes.load(), wall)
+                << "}";
+        }
+        out << "}";
+        if (symbolCount != 0) {
+            out << ",\"averageCodeLength\":" << averageLength
+                << ",\"maxCodeLength\":" << maxCodeLength.load()
+                << ",\"entropyBitsPerSymbol\":" << entropy;
+        }
+        out << ",\"achievedBitsPerSymbol\":" << achieved
+            << "}\n";
+        return;
+    }
+
+    out << "File: " << file.name << " (" << action << ")\n"
+        << std::left << "    " << std::setw(12) << "phase" << std::right
+        << std::setw(8)  << "calls"
+        << std::setw(12) << "wall ms"
+        << std::setw(12) << "cpu ms"
+        << std::setw(14) << "bytes"
+        << std::setw(10) << "MB/s"
+        << "\n"
+        << std::fixed << std::setprecision(3);
+    for (std::size_t phase = 0; phase < phaseCount; ++phase) {
+        PhaseCounters const&    counters    = phases[phase];
+        if (counters.calls.load() == 0) {
+            continue;
+        }
+        double                  wall        = counters.wallNanos.load() / 1e9;
+        out << std::left << "    " << std::setw(12) << phaseNames[phase] << std::right
+            << std::setw(8)  << counters.calls.load()
+            << std::setw(12) << wall * 1e3
+            << std::setw(12) << counters.cpuNanos.load() / 1e6
+            << std::setw(14) << counters.bytes.load();
+        if (counters.bytes.load() != 0) {
+            out << std::setw(10) << std::setprecision(1) << megaBytesPerSecond(counters.bytes.load(), wall) << std::setprecision(3);
+        }
+        else {
+            out << std::setw(10) << "-";
+        }
+        out << "\n";
+    }
+    out << std::left << "    " << std::setw(12) << "total" << std::right
+        << std::setw(8)  << ""
+        << std::setw(12) << file.wallSeconds * 1e3
+        << std::setw(12) << cpuSeconds * 1e3
+        << std::setw(14) << uncompressed
+        << std::setw(10) << std::setprecision(1) << megaBytesPerSecond(uncompressed, file.wallSeconds) << std::setprecision(3)
+        << "\n"
+        << "    Bytes:        " << file.bytesIn << " in " << file.bytesOut << " out";
+    if (file.action == '+') {
+        out << " (" << headerBytes.load() << " header)";
+    }
+    out << "\n";
+    if (symbolCount != 0) {
+        out << "    Code length:  average " << averageLength << " max " << maxCodeLength.load() << " bits\n"
+            << "    Entropy:      " << entropy << " bits/symbol\n";
+    }
+    out << "    Achieved:     " << achieved << " bits/symbol\n";
+}
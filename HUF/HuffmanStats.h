@@ -0,0 +1,94 @@
+#ifndef THORSANVIL_PUZZLE_HUFFMAN_STATS_H
+#define THORSANVIL_PUZZLE_HUFFMAN_STATS_H
+
+#include "Huffman.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <span>
+#include <array>
+#include <atomic>
+
+
+namespace ThorsAnvil::Puzzle
+{
+
+// Counters for the work done by the encoders and decoders (see huf --stats).
+// The encoders and decoders are given a pointer to a HuffmanStats object (nullptr turns the counting off).
+// The counters are atomic so the worker threads of the block format can share one object.
+// A timed phase costs two reads of each clock so the counters are cheap enough to leave on.
+class HuffmanStats
+{
+    public:
+        enum Phase {Histogram, BuildTree, ExportTree, Encode, Decode};
+        static constexpr std::size_t    phaseCount              = 5;
+        static constexpr char const*    phaseNames[phaseCount]  = {"histogram", "buildTree", "exportTree", "encode", "decode"};
+
+        // Add the wall and CPU (of the current thread) time of the scope to a phase.
+        // bytes is the amount of uncompressed data the phase worked on.
+        class Timer
+        {
+            private:
+                HuffmanStats*   stats;
+                Phase           phase;
+                std::uint64_t   bytes;
+                std::uint64_t   wallStart   = 0;
+                std::uint64_t   cpuStart    = 0;
+
+            public:
+                Timer(HuffmanStats* stats, Phase phase, std::uint64_t bytes = 0);
+                ~Timer();
+
+                Timer(Timer const&)             = delete;
+                Timer& operator=(Timer const&)  = delete;
+
+                // For phases where the size is only known at the end (like decoding).
+                void setBytes(std::uint64_t value)  {bytes = value;}
+        };
+
+        // The totals for a file (supplied by the caller).
+        struct File
+        {
+            std::string     name;
+            char            action;             // '+' compress '-' decompress
+            std::uint64_t   bytesIn;
+            std::uint64_t   bytesOut;
+            double          wallSeconds;
+        };
+
+    private:
+        struct PhaseCounters
+        {
+            std::atomic<std::uint64_t>  calls{0};
+            std::atomic<std::uint64_t>  wallNanos{0};
+            std::atomic<std::uint64_t>  cpuNanos{0};
+            std::atomic<std::uint64_t>  bytes{0};
+        };
+
+        std::array<PhaseCounters, phaseCount>   phases;
+        std::atomic<std::uint64_t>              headerBytes{0};     // Code tables and block framing.
+        std::atomic<std::uint64_t>              symbols{0};         // Symbols (including EOF markers) written with a Huffman code.
+        std::atomic<std::uint64_t>              codedBits{0};       // Bits used by those symbols.
+        std::atomic<std::uint64_t>              maxCodeLength{0};
+        std::atomic<double>                     entropyBits{0};     // Order 0 entropy of those symbols (in total).
+
+    public:
+        // Bytes of output that are not coded data.
+        void addHeader(std::uint64_t size);
+
+        // counts[symbol] symbols were written with codes[symbol].
+        void addCode(std::span<std::uint64_t const, Huffman::symbolCount> counts, std::span<Huffman::Code const, Huffman::symbolCount> codes);
+
+        // Write the counters (as text or a single line of JSON).
+        // The format of out (flags, precision and fill) is left as it was.
+        void report(std::ostream& out, File const& file, bool json) const;
+
+    private:
+        void add(Phase phase, std::uint64_t bytes, std::uint64_t wallNanos, std::uint64_t cpuNanos);
+};
+
+}
+
+#endif
@@ -0,0 +1,84 @@
+#include "HuffmanStream.h"
+
+#include <cstddef>
+#include <istream>
+#include <string>
+
+
+using namespace ThorsAnvil::Puzzle;
+
+// The input is not read until the first underflow().
+// Only one thread is used for the block format: blocks are decoded one at a time as they are needed.
+HuffmanInputBuf::HuffmanInputBuf(std::istream& in)
+    : in(in)
+    , blockDecoder(1)
+{
+    setg(nullptr, nullptr, nullptr);
+}
+
+HuffmanInputBuf::int_type HuffmanInputBuf::underflow()
+{
+    while (gptr() == egptr()) {
+        if (state == State::Start && !start()) {
+            error = true;
+            state = State::Done;
+        }
+        if (state == State::Done || !fill()) {
+            return traits_type::eof();
+        }
+    }
+    return traits_type::to_int_type(*gptr());
+}
+
+// Work out the format from the start of the input and read the header.
+bool HuffmanInputBuf::start()
+{
+    if (HuffmanBlockDecoder::isBlockFormat(in)) {
+        state = State::Blocks;
+        return blockDecoder.readHeader(in);
+    }
+    if (!decoder.buildTree(in)) {
+        return false;
+    }
+    state = State::Stream;
+    decoder.start(in);
+    buffer.resize(bufferSize + HuffmanDecoder::maxLetters);
+    return true;
+}
+
+// Decode the next piece of the input into the buffer.
+// Returns false once there is nothing left to decode.
+bool HuffmanInputBuf::fill()
+{
+    std::size_t     size;
+    if (state == State::Blocks) {
+        if (!blockDecoder.readBlock(in, buffer)) {
+            error = true;
+            state = State::Done;
+            return false;
+        }
+        size = buffer.size();
+        if (size == 0) {
+            state = State::Done;
+            return false;
+        }
+    }
+    else {
+        bool        finished;
+        bool        truncated;
+        size = decoder.decodeSome(buffer, finished, truncated);
+        if (finished) {
+            error = truncated;
+            state = State::Done;
+        }
+    }
+    setg(buffer.data(), buffer.data(), buffer.data() + size);
+    return true;
+}
+
+HuffmanInputStream::HuffmanInputStream(std::istream& in)
+    : std::istream(nullptr)
+    , buffer(in)
+{
+    rdbuf(&buffer);
+}
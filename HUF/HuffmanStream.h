@@ -0,0 +1,70 @@
+#ifndef THORSANVIL_PUZZLE_HUFFMAN_STREAM_H
+#define THORSANVIL_PUZZLE_HUFFMAN_STREAM_H
+
+#include "Huffman.h"
+#include "HuffmanBlock.h"
+
+#include <cstddef>
+#include <istream>
+#include <streambuf>
+#include <string>
+
+
+namespace ThorsAnvil::Puzzle
+{
+
+// A stream buffer that decompresses a .huf file as it is read.
+// Any code that reads a std::istream can read compressed data without decompressing it to disk first.
+// The format is detected from the start of the input (like huf -).
+//  Block format:       One block is decoded for each underflow() so only one block is held in memory.
+//  Other formats:      The tree is read then bufferSize bytes are decoded for each underflow().
+// The input is read sequentially so it can be a pipe. The stream can not seek.
+// If the input is not a valid .huf file the stream ends early and valid() returns false
+// (this includes a file that is cut off before its EOF marker).
+class HuffmanInputBuf: public std::streambuf
+{
+    public:
+        static constexpr std::size_t bufferSize     = 64 * 1024;
+
+    private:
+        enum class State {Start, Blocks, Stream, Done};
+
+        std::istream&           in;
+        State                   state       = State::Start;
+        bool                    error       = false;
+        HuffmanBlockDecoder     blockDecoder;
+        HuffmanDecoder          decoder;
+        std::string             buffer;
+
+    public:
+        HuffmanInputBuf(std::istream& in);
+
+        HuffmanInputBuf(HuffmanInputBuf const&)             = delete;
+        HuffmanInputBuf& operator=(HuffmanInputBuf const&)  = delete;
+
+        // False if the input was found to be invalid (so far).
+        bool            valid() const   {return !error;}
+
+    protected:
+        int_type        underflow() override;
+
+    private:
+        bool            start();
+        bool            fill();
+};
+
+// An input stream that decompresses a .huf file (see HuffmanInputBuf).
+class HuffmanInputStream: public std::istream
+{
+    private:
+        HuffmanInputBuf buffer;
+
+    public:
+        HuffmanInputStream(std::istream& in);
+
+        bool            valid() const   {return buffer.valid();}
+};
+
+}
+
+#endif
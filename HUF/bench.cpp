@@ -0,0 +1,425 @@
+#include "Huffman.h"
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <span>
+#include <vector>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+using ThorsAnvil::Puzzle::Huffman;
+using ThorsAnvil::Puzzle::HuffmanEncoder;
+using ThorsAnvil::Puzzle::HuffmanDecoder;
+
+/*
+ * Benchmark each phase of the Huffman codec on a set of corpora at a range of sizes.
+ *
+ *  histogram:  Counting the bytes (Huffman::histogram()).
+ *  tree:       Building the canonical code from the histogram (HuffmanEncoder::buildTree()).
+ *              This does not depend on the size of the input so it is shown as the
+ *              throughput it allows for an input of that size.
+ *  encode:     Encoding the input with the code (HuffmanEncoder::encode()).
+ *  decode:     Decompressing the output of HuffmanEncoder::compress() (includes building the decode table).
+ *
+ * The corpora are generated with a fixed seed so the results are repeatable.
+ * The generator is also available on its own (--generate) to make input files for huf.
+ */
+struct Options
+{
+    std::size_t     minSize     = 1024;
+    std::size_t     maxSize     = std::size_t{1} << 30;
+    std::size_t     samples     = 3;
+    std::string     corpus;
+    std::string     text        = "test/test.txt";
+    std::string     generate;
+};
+
+int usage()
+{
+    std::cerr << "Usage: huf_bench [--min-size=<size>[KMG]] [--max-size=<size>[KMG]] [--samples=<count>] [--corpus=<name>] [--text=<file>]\n"
+              << "       huf_bench --generate=<name> [--max-size=<size>[KMG]]\n"
+              << "Corpora: text random zipf runs binary\n";
+    return 1;
+}
+
+/*
+ * Parse a count (a plain number).
+ */
+bool parseCount(std::string_view value, std::size_t& result)
+{
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+    return ec == std::errc{} && end == value.data() + value.size();
+}
+
+/*
+ * Parse a size in bytes: a number with an optional K/M/G suffix.
+ */
+bool parseSize(std::string_view value, std::size_t& result)
+{
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+    std::string_view    suffix(end, value.data() + value.size() - end);
+    if (ec != std::errc{} || suffix.size() > 1) {
+        return false;
+    }
+    if (suffix == "K") {
+        result *= 1024;
+    }
+    else if (suffix == "M") {
+        result *= 1024 * 1024;
+    }
+    else if (suffix == "G") {
+        result *= 1024 * 1024 * 1024;
+    }
+    else if (!suffix.empty()) {
+        return false;
+    }
+    return true;
+}
+
+std::string formatSize(std::size_t size)
+{
+    static constexpr char const* units[] = {"", "K", "M", "G"};
+    std::size_t unit = 0;
+    while (unit < 3 && size >= 1024 && size % 1024 == 0) {
+        size /= 1024;
+        ++unit;
+    }
+    return std::to_string(size) + units[unit];
+}
+
+/*
+ * A small fast generator (xorshift64*).
+ * The standard distributions are not guaranteed to give the same values
+ * on every platform so the corpora are built from this directly.
+ */
+class Random
+{
+    private:
+        std::uint64_t   state;
+
+    public:
+        Random(std::uint64_t seed)
+            : state(seed)
+        {}
+
+        std::uint64_t next()
+        {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return state * 0x2545F4914F6CDD1DULL;
+        }
+        // A value in the range [0, range).
+        std::uint64_t below(std::uint64_t range)
+        {
+            return next() % range;
+        }
+};
+
+/*
+ * Corpus generators.
+ * Each fills data with size bytes.
+ */
+using Corpus = std::vector<char>;
+
+// The text file repeated as many times as needed.
+bool generateText(Corpus& data, std::size_t size, std::string const& fileName)
+{
+    std::ifstream       file(fileName, std::ios::binary);
+    std::string         text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (text.empty()) {
+        std::cerr << "File: " << fileName << " could not be read\n";
+        return false;
+    }
+    data.resize(size);
+    for (std::size_t pos = 0; pos < size; pos += text.size()) {
+        std::memcpy(data.data() + pos, text.data(), std::min(text.size(), size - pos));
+    }
+    return true;
+}
+
+// Every byte value is equally likely (Huffman coding can not compress this).
+void generateRandom(Corpus& data, std::size_t size)
+{
+    Random      random(0x5EED0001);
+    data.resize(size);
+    std::size_t pos = 0;
+    for (; size - pos >= 8; pos += 8) {
+        std::uint64_t value = random.next();
+        std::memcpy(data.data() + pos, &value, sizeof(value));
+    }
+    for (; pos < size; ++pos) {
+        data[pos] = static_cast<char>(random.next());
+    }
+}
+
+// A skewed distribution: the byte of rank 'r' occurs with probability proportional to 1 / r.
+// The bytes are given their ranks in a random order.
+void generateZipf(Corpus& data, std::size_t size)
+{
+    Random                          random(0x5EED0002);
+    std::array<unsigned char, 256>  symbols;
+    std::iota(symbols.begin(), symbols.end(), 0);
+    for (std::size_t loop = symbols.size() - 1; loop > 0; --loop) {
+        std::swap(symbols[loop], symbols[random.below(loop + 1)]);
+    }
+
+    // Cumulative probabilities scaled to 32 bits.
+    std::array<std::uint64_t, 256>  limits;
+    double                          total   = 0;
+    for (std::size_t rank = 1; rank <= 256; ++rank) {
+        total += 1.0 / rank;
+    }
+    double                          sum     = 0;
+    for (std::size_t rank = 1; rank <= 256; ++rank) {
+        sum += 1.0 / rank;
+        limits[rank - 1] = static_cast<std::uint64_t>(sum / total * 4294967296.0);
+    }
+    limits[255] = std::uint64_t{1} << 32;
+
+    data.resize(size);
+    for (auto& value: data) {
+        std::uint64_t   point   = random.next() >> 32;
+        std::size_t     rank    = std::upper_bound(limits.begin(), limits.end(), point) - limits.begin();
+        value = static_cast<char>(symbols[rank]);
+    }
+}
+
+// Runs (of 1 to 256 bytes) of a single byte from a small alphabet.
+void generateRuns(Corpus& data, std::size_t size)
+{
+    Random      random(0x5EED0003);
+    data.resize(size);
+    for (std::size_t pos = 0; pos < size;) {
+        std::size_t length  = std::min(size - pos, 1 + random.below(256));
+        char        value   = static_cast<char>('a' + random.below(8));
+        std::memset(data.data() + pos, value, length);
+        pos += length;
+    }
+}
+
+// Fixed size little endian records like a binary log:
+//  std::uint32_t   Sequence number.
+//  std::uint32_t   Time stamp (increasing by small steps).
+//  std::uint16_t   Small value.
+//  std::uint8_t    Flags (mostly zero).
+//  std::uint8_t    Type (one of four).
+//  float           Measurement.
+void generateBinary(Corpus& data, std::size_t size)
+{
+    struct Record
+    {
+        std::uint32_t   sequence;
+        std::uint32_t   time;
+        std::uint16_t   value;
+        std::uint8_t    flags;
+        std::uint8_t    type;
+        float           measurement;
+    };
+    Random      random(0x5EED0004);
+    Record      record{0, 1700000000, 0, 0, 0, 0};
+    data.resize(size);
+    for (std::size_t pos = 0; pos < size; pos += sizeof(record)) {
+        record.sequence     += 1;
+        record.time         += random.below(4);
+        record.value        = random.below(1000);
+        record.flags        = random.below(16) == 0 ? random.below(256) : 0;
+        record.type         = random.below(4);
+        record.measurement  = 20.0f + random.below(1000) / 100.0f;
+        std::memcpy(data.data() + pos, &record, std::min(sizeof(record), size - pos));
+    }
+}
+
+bool generate(std::string const& name, Corpus& data, std::size_t size, Options const& options)
+{
+    if (name == "text")     {return generateText(data, size, options.text);}
+    if (name == "random")   {generateRandom(data, size);    return true;}
+    if (name == "zipf")     {generateZipf(data, size);      return true;}
+    if (name == "runs")     {generateRuns(data, size);      return true;}
+    if (name == "binary")   {generateBinary(data, size);    return true;}
+    std::cerr << "Unknown corpus: " << name << "\n";
+    return false;
+}
+
+/*
+ * A stream buffer that writes into a fixed block of memory.
+ * Used so the encode phase is not timing memory allocation.
+ */
+class SpanOutputBuf: public std::streambuf
+{
+    public:
+        SpanOutputBuf(std::span<char> buffer)
+        {
+            setp(buffer.data(), buffer.data() + buffer.size());
+        }
+        void            reset()         {setp(pbase(), epptr());}
+        std::size_t     size() const    {return pptr() - pbase();}
+};
+
+/*
+ * Time an action on an input of 'size' bytes.
+ * Small inputs are repeated so each sample takes a measurable time.
+ * Returns the best throughput (in MB/s) of the samples.
+ */
+template<typename Action>
+double measure(std::size_t size, std::size_t samples, Action&& action)
+{
+    static constexpr std::size_t sampleBytes = 16 * 1024 * 1024;
+
+    std::size_t     repeat  = std::max<std::size_t>(1, sampleBytes / size);
+    double          best    = std::numeric_limits<double>::max();
+    for (std::size_t sample = 0; sample < samples; ++sample) {
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t loop = 0; loop < repeat; ++loop) {
+            action();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count() / repeat);
+    }
+    return size / best / 1e6;
+}
+
+/*
+ * Benchmark all phases on the first 'size' bytes of the corpus.
+ * Returns false if the decoded output does not match the input.
+ */
+bool benchmark(std::string const& name, std::span<char const> input, Options const& options)
+{
+    HuffmanEncoder              encoder(true);
+    HuffmanDecoder              decoder;
+
+    // The buffers are not initialized so the pages that are never written are never allocated
+    // (the worst case compressed size is much larger than the actual size).
+    std::size_t                 bufferSize  = encoder.maxCompressedSize(input.size());
+    auto                        buffer      = std::make_unique_for_overwrite<std::byte[]>(bufferSize);
+    auto                        output      = std::make_unique_for_overwrite<std::byte[]>(input.size());
+    std::span<std::byte>        compressed(buffer.get(), bufferSize);
+    std::span<std::byte>        decoded(output.get(), input.size());
+    std::span<std::byte const>  in(std::as_bytes(input));
+
+    std::size_t                 compressedSize = encoder.compress(in, compressed);
+    std::size_t                 decodedSize    = 0;
+    if (compressedSize == 0 || !decoder.decompress(compressed.first(compressedSize), decoded, decodedSize)
+        || decodedSize != input.size() || !std::equal(in.begin(), in.end(), decoded.begin())) {
+        std::cerr << name << " " << formatSize(input.size()) << ": round trip failed\n";
+        return false;
+    }
+
+    Huffman::Histogram          counts;
+    double histogramSpeed = measure(input.size(), options.samples, [&]()
+    {
+        counts.fill(0);
+        Huffman::histogram(input, counts);
+    });
+    double treeSpeed = measure(input.size(), options.samples, [&]()
+    {
+        encoder.buildTree(counts);
+    });
+    double decodeSpeed = measure(input.size(), options.samples, [&]()
+    {
+        decoder.decompress(compressed.first(compressedSize), decoded, decodedSize);
+    });
+    // Done with the compressed data so the encoder can write over it.
+    SpanOutputBuf               encoded({reinterpret_cast<char*>(compressed.data()), compressed.size()});
+    std::ostream                stream(&encoded);
+    double encodeSpeed = measure(input.size(), options.samples, [&]()
+    {
+        encoded.reset();
+        encoder.encode(input, stream);
+    });
+
+    std::cout << std::left  << std::setw(8)  << name
+              << std::right << std::setw(6)  << formatSize(input.size())
+              << std::fixed << std::setprecision(3)
+              << std::setw(9)  << static_cast<double>(input.size()) / compressedSize
+              << std::setprecision(1)
+              << std::setw(12) << histogramSpeed
+              << std::setw(12) << treeSpeed
+              << std::setw(12) << encodeSpeed
+              << std::setw(12) << decodeSpeed
+              << std::endl;
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    Options         options;
+
+    for (int loop = 1; loop < argc; ++loop) {
+        std::string_view    option(argv[loop]);
+        std::string_view    value;
+        if (auto split = option.find('='); split != std::string_view::npos) {
+            value   = option.substr(split + 1);
+            option  = option.substr(0, split);
+        }
+
+        if (option == "--min-size" && parseSize(value, options.minSize) && options.minSize != 0) {
+        }
+        else if (option == "--max-size" && parseSize(value, options.maxSize) && options.maxSize != 0) {
+        }
+        else if (option == "--samples" && parseCount(value, options.samples) && options.samples != 0) {
+        }
+        else if (option == "--corpus" && !value.empty()) {
+            options.corpus = value;
+        }
+        else if (option == "--text" && !value.empty()) {
+            options.text = value;
+        }
+        else if (option == "--generate" && !value.empty()) {
+            options.generate = value;
+        }
+        else {
+            return usage();
+        }
+    }
+
+    Corpus          data;
+    if (!options.generate.empty()) {
+        if (!generate(options.generate, data, options.maxSize, options)) {
+            return 1;
+        }
+        std::cout.write(data.data(), data.size());
+        return std::cout ? 0 : 1;
+    }
+
+    std::vector<std::string>    corpora{"text", "random", "zipf", "runs", "binary"};
+    if (!options.corpus.empty()) {
+        corpora = {options.corpus};
+    }
+
+    std::cout << "Throughput in MB/s of input (ratio is original size / compressed size)\n"
+              << std::left  << std::setw(8)  << "corpus"
+              << std::right << std::setw(6)  << "size"
+              << std::setw(9)  << "ratio"
+              << std::setw(12) << "histogram"
+              << std::setw(12) << "tree"
+              << std::setw(12) << "encode"
+              << std::setw(12) << "decode"
+              << "\n";
+
+    int             result = 0;
+    for (auto const& name: corpora) {
+        // Generate the largest size once; the smaller sizes use the start of it.
+        if (!generate(name, data, options.maxSize, options)) {
+            return 1;
+        }
+        for (std::size_t size = options.minSize; size <= options.maxSize; size *= 4) {
+            if (!benchmark(name, {data.data(), size}, options)) {
+                result = 1;
+            }
+        }
+    }
+    return result;
+}
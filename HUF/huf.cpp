@@ -1,56 +1,612 @@
 #include "Huffman.h"
+#include "HuffmanBlock.h"
+#include "HuffmanDictionary.h"
+#include "HuffmanIO.h"
+#include "HuffmanLZ.h"
+#include "HuffmanStats.h"
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <optional>
+#include <span>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <limits>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 using ThorsAnvil::Puzzle::HuffmanEncoder;
 using ThorsAnvil::Puzzle::HuffmanDecoder;
+using ThorsAnvil::Puzzle::HuffmanBlockEncoder;
+using ThorsAnvil::Puzzle::HuffmanBlockDecoder;
+using ThorsAnvil::Puzzle::HuffmanDictionary;
+using ThorsAnvil::Puzzle::HuffmanLZ;
+using ThorsAnvil::Puzzle::MappedFile;
+using ThorsAnvil::Puzzle::MemoryInputBuf;
+using ThorsAnvil::Puzzle::AsyncInputBuf;
+using ThorsAnvil::Puzzle::OutputFile;
+using ThorsAnvil::Puzzle::HuffmanStats;
 
-int main(int argc, char* argv[])
+/*
+ * Command line options.
+ */
+struct Options
 {
-    if (argc != 3) {
-        std::cerr << "Usage: huf [+-] <filename>\n";
-        return 1;
+    bool            canonical       = false;
+    std::size_t     codeLengthLimit = HuffmanEncoder::defaultMaxCodeLength;
+    bool            block           = false;
+    std::size_t     blockSize       = HuffmanBlockEncoder::defaultBlockSize;
+    HuffmanBlockEncoder::Coding coding  = HuffmanBlockEncoder::Coding::Huffman;
+    std::size_t     threads         = 0;
+    bool            range           = false;
+    std::size_t     rangeOffset     = 0;
+    std::size_t     rangeLength     = 0;
+    std::string     filesFrom;
+    bool            stats           = false;
+    bool            statsJson       = false;
+    HuffmanDictionary const* dictionary = nullptr;
+    std::string     train;
+    std::size_t     dictionaryId    = HuffmanDictionary::firstUserId;
+    bool            builtin         = false;
+};
+
+int usage()
+{
+    std::cerr << "Usage: huf [--canonical[=<maxLength>]] [--block[=<size>[KM]]] [--interleave] [--lz] [--dictionary=<id>|<file>] [--threads=<count>] [--range=<offset>:<length>] [--files-from=<list>] [--stats[=json]] [+-] [<filename>...|-]\n"
+              << "       huf --train=<dictionary> [--dictionary-id=<id> [--builtin]] [--canonical=<maxLength>] <sample>...\n";
+    return 1;
+}
+
+/*
+ * Parse a count or an id (a plain number).
+ */
+bool parseCount(std::string_view value, std::size_t& result)
+{
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+    return ec == std::errc{} && end == value.data() + value.size();
+}
+
+/*
+ * Parse a size in bytes: a number with an optional K/M suffix.
+ */
+bool parseSize(std::string_view value, std::size_t& result)
+{
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+    std::string_view    suffix(end, value.data() + value.size() - end);
+    if (ec != std::errc{} || suffix.size() > 1) {
+        return false;
     }
-    if (argv[1][0] != '+' && argv[1][0] != '-') {
-        std::cerr << "Usage: huf [+-] <filename>\n";
-        return 1;
+    if (suffix == "K") {
+        result *= 1024;
     }
-    std::ifstream   file(argv[2]);
-    if (!file) {
-        std::cerr << "File: " << argv[2] << " could not be opened\n";
-        return 1;
+    else if (suffix == "M") {
+        result *= 1024 * 1024;
+    }
+    else if (!suffix.empty()) {
+        return false;
     }
+    return true;
+}
+
+/*
+ * The streams used by processFile().
+ * They are owned by the caller so the sizes are still available when processFile() returns (see --stats).
+ */
+struct FileStreams
+{
+    std::optional<AsyncInputBuf>    pipeBuf;
+    std::optional<OutputFile>       outFile;
+};
 
-    if (argv[1][0] == '+') {
+/*
+ * Compress ('+') or decompress ('-') a single file.
+ * Messages are written to log.
+ * Returns the exit status for the file.
+ */
+int processFile(Options options, char action, std::string const& fileName, std::ostream& log, FileStreams& streams, HuffmanStats* stats)
+{
+    // A file name of "-" (or no file name) streams from std::cin to std::cout.
+    // The input can only be read once so compression always uses the block format.
+    // If the input is a pipe it is read on a background thread (so reading overlaps with the work).
+    // Otherwise the file is memory mapped and the data is used in place
+    // (falling back to a normal stream if the file can not be mapped).
+    bool                        stream  = fileName == "-";
+    std::optional<MappedFile>   mapped;
+    std::optional<MemoryInputBuf> mappedBuf;
+    std::optional<AsyncInputBuf>& pipeBuf = streams.pipeBuf;
+    std::istream                mappedStream(nullptr);
+    std::ifstream               file;
+    std::span<char const>       data;
+    if (stream) {
+        std::ios_base::sync_with_stdio(false);
+        std::cin.tie(nullptr);
+        options.block = true;
+        if (::lseek(STDIN_FILENO, 0, SEEK_CUR) == -1) {
+            mappedStream.rdbuf(&pipeBuf.emplace(STDIN_FILENO));
+        }
+    }
+    else if (mapped.emplace(fileName); mapped->isOpen()) {
+        data = mapped->span();
+        mappedStream.rdbuf(&mappedBuf.emplace(data));
+    }
+    else {
+        file.open(fileName);
+        if (!file) {
+            log << "File: " << fileName << " could not be opened\n";
+            return 1;
+        }
+    }
+    bool            useMap  = mappedBuf.has_value();
+    std::istream&   in      = pipeBuf ? mappedStream : stream ? std::cin : useMap ? mappedStream : file;
+
+    std::optional<OutputFile>&  outFile = streams.outFile;
+    auto openOutput = [&](char const* extension) -> std::ostream*
+    {
+        if (stream) {
+            return &outFile.emplace(STDOUT_FILENO);
+        }
+        std::string     outName(std::string(fileName) + extension);
+        if (!outFile.emplace(outName)) {
+            log << "File: " << outName << " can not be opened for output\n";
+            return nullptr;
+        }
+        return &*outFile;
+    };
+
+    auto encodeBlocks = [&]()
+    {
+        std::ostream*   out = openOutput(".huf");
+        if (!out) {
+            return 1;
+        }
+        HuffmanBlockEncoder     encoder(options.blockSize, options.threads, options.codeLengthLimit, options.coding);
+        encoder.setStats(stats);
+        if (useMap) {
+            encoder.encode(data, *out);
+        }
+        else {
+            encoder.encode(in, *out);
+        }
+        return 0;
+    };
+
+    if (action == '+' && options.dictionary) {
+        // The code is known in advance so the input is encoded in a single pass.
         HuffmanEncoder  encoder;
-        if (encoder.buildTree(file)) {
-            std::string     outName(std::string(argv[2]) + ".huf");
-            std::ofstream   out(outName);
-            if (!out) {
-                std::cerr << "File: " << outName << " can not be opened for output\n";
-                return 1;
+        encoder.setStats(stats);
+        encoder.useDictionary(*options.dictionary);
+        std::ostream*   out = openOutput(".huf");
+        if (!out) {
+            return 1;
+        }
+        encoder.exportTree(*out);
+        if (useMap) {
+            encoder.encode(data, *out);
+        }
+        else {
+            encoder.encode(in, *out);
+        }
+        return 0;
+    }
+    else if (action == '+' && options.block) {
+        return encodeBlocks();
+    }
+    else if (action == '+' && useMap) {
+        HuffmanEncoder  encoder(options.canonical, options.codeLengthLimit);
+        encoder.setStats(stats);
+        std::size_t     cost = encoder.buildTree(data);
+        if (cost == 0) {
+            log << "File: " << fileName << " is empty\n";
+            return 1;
+        }
+        if (cost > data.size()) {
+            // The file does not get smaller as a whole.
+            // Use the block format: the blocks that do not compress are stored as they are.
+            return encodeBlocks();
+        }
+        std::ostream*   out = openOutput(".huf");
+        if (!out) {
+            return 1;
+        }
+        encoder.exportTree(*out);
+        encoder.encode(data, *out);
+        return 0;
+    }
+    else if (action == '+') {
+        // The same as the mapped file but the file is read twice (once to count the characters).
+        HuffmanEncoder::Histogram   counts{};
+        std::uint64_t               size = 0;
+        {
+            HuffmanStats::Timer     timer(stats, HuffmanStats::Histogram);
+            std::vector<char>       buffer(64 * 1024);
+            while (in.read(buffer.data(), buffer.size()) || in.gcount() != 0) {
+                HuffmanEncoder::histogram({buffer.data(), static_cast<std::size_t>(in.gcount())}, counts);
+                size += in.gcount();
             }
-            file.clear();
-            file.seekg(0);
-            encoder.exportTree(out);
-            encoder.encode(file, out);
-            return 0;
+            timer.setBytes(size);
+        }
+        in.clear();
+        in.seekg(0);
+
+        HuffmanEncoder  encoder(options.canonical, options.codeLengthLimit);
+        encoder.setStats(stats);
+        std::size_t     cost = encoder.buildTree(counts);
+        if (cost == 0) {
+            log << "File: " << fileName << " is empty\n";
+            return 1;
+        }
+        if (cost > size) {
+            // The file does not get smaller as a whole (see above).
+            return encodeBlocks();
+        }
+        std::ostream*   out = openOutput(".huf");
+        if (!out) {
+            return 1;
         }
+        encoder.exportTree(*out);
+        encoder.encode(in, *out);
+        return 0;
+    }
+    else if (HuffmanBlockDecoder::isBlockFormat(in)) {
+        std::ostream*   out = openOutput(".dec");
+        if (!out) {
+            return 1;
+        }
+        // Use the index to decode the blocks in parallel.
+        // Fall back to decoding the blocks one after the other if there is no index
+        // (or the input is a pipe and can not seek to the index).
+        HuffmanBlockDecoder     decoder(options.threads);
+        decoder.setStats(stats);
+        bool                    indexed = useMap ? decoder.readIndex(data) : decoder.readIndex(in);
+        if (options.range && !indexed) {
+            log << "File: " << fileName << " does not have a block index\n";
+            return 1;
+        }
+        bool                    ok      = options.range && useMap   ? decoder.decodeRange(data, *out, options.rangeOffset, options.rangeLength)
+                                        : options.range             ? decoder.decodeRange(in, *out, options.rangeOffset, options.rangeLength)
+                                        : indexed && useMap         ? decoder.decodeParallel(data, *out)
+                                        : indexed                   ? decoder.decodeParallel(in, *out)
+                                        :                             decoder.decode(in, *out);
+        if (!ok) {
+            log << "File: " << fileName << " is not a valid huf file\n";
+            return 1;
+        }
+        return 0;
+    }
+    else if (options.range) {
+        // Only the block format has an index to find the range with.
+        log << "File: " << fileName << " does not have a block index\n";
+        return 1;
     }
     else {
         HuffmanDecoder  decoder;
-        if (decoder.buildTree(file)) {
-            std::string     outName(std::string(argv[2]) + ".dec");
-            std::ofstream   out(outName);
+        decoder.setStats(stats);
+        if (decoder.buildTree(in)) {
+            std::ostream*   out = openOutput(".dec");
             if (!out) {
-                std::cerr << "File: " << outName << " can not be opened for output\n";
                 return 1;
             }
-            decoder.decode(file, out);
+            if (useMap) {
+                decoder.decode(data.subspan(in.tellg()), *out);
+            }
+            else {
+                decoder.decode(in, *out);
+            }
             return 0;
         }
+        log << "File: " << fileName << " is not a valid huf file (or uses an unknown dictionary)\n";
     }
     return 1;
 }
+
+/*
+ * The size of the input file.
+ * A pipe has no size so it is the number of bytes read.
+ */
+std::uint64_t inputSize(std::string const& fileName, FileStreams const& streams)
+{
+    if (streams.pipeBuf) {
+        return streams.pipeBuf->size();
+    }
+    struct stat     info;
+    int             status = fileName == "-" ? ::fstat(STDIN_FILENO, &info) : ::stat(fileName.c_str(), &info);
+    return status == 0 ? info.st_size : 0;
+}
+
+/*
+ * Wait for the output to be written.
+ * The writes happen on a background thread so a failure (disk full, a closed pipe) is only seen here.
+ */
+int closeOutput(int result, std::string const& fileName, std::ostream& log, FileStreams& streams)
+{
+    if (streams.outFile && !streams.outFile->close() && result == 0) {
+        log << "File: " << fileName << " could not be written\n";
+        return 1;
+    }
+    return result;
+}
+
+/*
+ * Compress ('+') or decompress ('-') a single file.
+ * With --stats the counters for the file are written to log once the output has been written.
+ */
+int processFile(Options const& options, char action, std::string const& fileName, std::ostream& log)
+{
+    FileStreams     streams;
+    if (!options.stats) {
+        int         result      = processFile(options, action, fileName, log, streams, nullptr);
+        return closeOutput(result, fileName, log, streams);
+    }
+
+    HuffmanStats    stats;
+    auto            start       = std::chrono::steady_clock::now();
+    int             result      = processFile(options, action, fileName, log, streams, &stats);
+    result                      = closeOutput(result, fileName, log, streams);
+    std::uint64_t   bytesOut    = streams.outFile ? streams.outFile->size() : 0;
+    streams.outFile.reset();
+    std::chrono::duration<double>   wall = std::chrono::steady_clock::now() - start;
+
+    if (result == 0) {
+        stats.report(log, {fileName, action, inputSize(fileName, streams), bytesOut, wall.count()}, options.statsJson);
+    }
+    return result;
+}
+
+/*
+ * Build a dictionary from the histogram of the sample files (--train).
+ */
+int trainDictionary(Options const& options, std::vector<std::string> const& samples)
+{
+    HuffmanEncoder::Histogram   counts{};
+    std::vector<char>           buffer(64 * 1024);
+    for (auto const& sample: samples) {
+        std::ifstream   file(sample);
+        if (!file) {
+            std::cerr << "File: " << sample << " could not be opened\n";
+            return 1;
+        }
+        while (file.read(buffer.data(), buffer.size()) || file.gcount() != 0) {
+            HuffmanEncoder::histogram({buffer.data(), static_cast<std::size_t>(file.gcount())}, counts);
+        }
+    }
+
+    HuffmanDictionary   dictionary = HuffmanDictionary::train(options.dictionaryId, counts, options.codeLengthLimit);
+    std::ofstream       out(options.train, std::ios::binary);
+    dictionary.save(out);
+    if (!out) {
+        std::cerr << "File: " << options.train << " could not be written\n";
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Find the dictionary for --dictionary.
+ * The value is the id of a dictionary or the name of a dictionary file.
+ * A dictionary file is also registered so files compressed with it can be decompressed.
+ * A dictionary file can not replace a compiled in dictionary.
+ */
+HuffmanDictionary const* findDictionary(std::string_view value)
+{
+    std::uint32_t   id;
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), id);
+    if (ec == std::errc{} && end == value.data() + value.size()) {
+        return HuffmanDictionary::find(id);
+    }
+
+    std::ifstream       file{std::string(value), std::ios::binary};
+    HuffmanDictionary   dictionary;
+    if (!file || !dictionary.load(file)) {
+        return nullptr;
+    }
+    if (!HuffmanDictionary::add(dictionary)) {
+        std::cerr << "Dictionary: " << value << " uses the id of a compiled in dictionary (" << dictionary.getId() << ")\n";
+        return nullptr;
+    }
+    return HuffmanDictionary::find(dictionary.getId());
+}
+
+/*
+ * Process a list of files on a pool of worker threads.
+ * Each file is handled by a single thread (the pool provides the parallelism).
+ * The largest files are started first so the small files fill in the gaps at the end.
+ * The messages for each file are written together once the file is finished.
+ */
+int processFiles(Options options, char action, std::vector<std::string> const& files)
+{
+    std::size_t     threads = options.threads != 0 ? options.threads : std::max(std::thread::hardware_concurrency(), 1U);
+    options.threads = 1;
+
+    std::vector<std::pair<std::uintmax_t, std::string const*>>   work;
+    for (auto const& file: files) {
+        std::error_code     error;
+        std::uintmax_t      size = std::filesystem::file_size(file, error);
+        work.emplace_back(error ? 0 : size, &file);
+    }
+    std::stable_sort(std::begin(work), std::end(work), [](auto const& l, auto const& r){return l.first > r.first;});
+
+    std::atomic<std::size_t>    next{0};
+    std::atomic<std::size_t>    failed{0};
+    std::mutex                  logMutex;
+    auto worker = [&]()
+    {
+        for (std::size_t index = next++; index < work.size(); index = next++) {
+            std::string const&  fileName = *work[index].second;
+            std::ostringstream  log;
+            int                 result;
+            if (fileName == "-") {
+                log << "File: - can not be used with other files\n";
+                result = 1;
+            }
+            else {
+                try {
+                    result = processFile(options, action, fileName, log);
+                }
+                catch (std::exception const& e) {
+                    log << "File: " << fileName << " failed: " << e.what() << "\n";
+                    result = 1;
+                }
+            }
+            if (result != 0) {
+                ++failed;
+            }
+            if (!log.view().empty()) {
+                std::lock_guard     lock(logMutex);
+                std::cerr << log.view();
+            }
+        }
+    };
+
+    std::vector<std::thread>    workers;
+    for (std::size_t loop = 0; loop < std::min(threads, work.size()); ++loop) {
+        workers.emplace_back(worker);
+    }
+    for (auto& thread: workers) {
+        thread.join();
+    }
+
+    if (failed != 0) {
+        std::cerr << "huf: " << failed << " of " << files.size() << " files failed\n";
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    Options         options;
+
+    int loop = 1;
+    for (; loop < argc && std::string_view(argv[loop]).starts_with("--"); ++loop) {
+        std::string_view    option(argv[loop]);
+        std::string_view    value;
+        if (auto split = option.find('='); split != std::string_view::npos) {
+            value   = option.substr(split + 1);
+            option  = option.substr(0, split);
+        }
+
+        if (option == "--canonical") {
+            options.canonical = true;
+            if (!value.empty() && (!parseCount(value, options.codeLengthLimit) || options.codeLengthLimit < HuffmanEncoder::minCodeLength || options.codeLengthLimit > HuffmanEncoder::maxCodeLength)) {
+                std::cerr << "Canonical code length must be in the range " << HuffmanEncoder::minCodeLength << "-" << HuffmanEncoder::maxCodeLength << "\n";
+                return 1;
+            }
+        }
+        else if (option == "--block") {
+            options.block = true;
+            if (!value.empty() && (!parseSize(value, options.blockSize) || options.blockSize == 0)) {
+                std::cerr << "Invalid block size: " << value << "\n";
+                return 1;
+            }
+        }
+        else if (option == "--interleave" && value.empty()) {
+            options.block       = true;
+            options.coding      = HuffmanBlockEncoder::Coding::Interleaved;
+        }
+        else if (option == "--lz" && value.empty()) {
+            options.block       = true;
+            options.coding      = HuffmanBlockEncoder::Coding::LZ;
+        }
+        else if (option == "--dictionary" && !value.empty()) {
+            options.dictionary = findDictionary(value);
+            if (!options.dictionary) {
+                std::cerr << "Invalid dictionary: " << value << "\n";
+                return 1;
+            }
+        }
+        else if (option == "--train" && !value.empty()) {
+            options.train = value;
+        }
+        else if (option == "--dictionary-id" && parseCount(value, options.dictionaryId) && options.dictionaryId <= std::numeric_limits<std::uint32_t>::max()) {
+        }
+        else if (option == "--builtin" && value.empty()) {
+            options.builtin = true;
+        }
+        else if (option == "--threads" && parseCount(value, options.threads)) {
+        }
+        else if (option == "--files-from" && !value.empty()) {
+            options.filesFrom = value;
+        }
+        else if (option == "--stats" && (value.empty() || value == "json")) {
+            options.stats       = true;
+            options.statsJson   = value == "json";
+        }
+        else if (option == "--range") {
+            auto split = value.find(':');
+            options.range = true;
+            if (split == std::string_view::npos || !parseSize(value.substr(0, split), options.rangeOffset) || !parseSize(value.substr(split + 1), options.rangeLength)) {
+                std::cerr << "Invalid range: " << value << "\n";
+                return 1;
+            }
+        }
+        else {
+            return usage();
+        }
+    }
+    if (!options.train.empty()) {
+        if (argc - loop < 1) {
+            return usage();
+        }
+        if (options.dictionaryId < HuffmanDictionary::firstUserId && !options.builtin) {
+            std::cerr << "Dictionary ids below " << HuffmanDictionary::firstUserId << " are reserved for the compiled in dictionaries (use --builtin to regenerate one)\n";
+            return 1;
+        }
+        return trainDictionary(options, {argv + loop, argv + argc});
+    }
+    if (options.coding == HuffmanBlockEncoder::Coding::LZ && options.blockSize > HuffmanLZ::maxInputSize) {
+        std::cerr << "The block size for --lz can not be more than " << HuffmanLZ::maxInputSize << " bytes\n";
+        return 1;
+    }
+    if (options.dictionary && options.block) {
+        std::cerr << "--dictionary can not be used with --block, --interleave or --lz\n";
+        return 1;
+    }
+    if (argc - loop < 1) {
+        return usage();
+    }
+    char const* action      = argv[loop];
+    if (action[0] != '+' && action[0] != '-') {
+        return usage();
+    }
+    if (options.range && action[0] == '+') {
+        std::cerr << "--range can only be used to decompress (-)\n";
+        return 1;
+    }
+
+    // The files to process are on the command line and/or in the list file (one per line).
+    std::vector<std::string>    files(argv + loop + 1, argv + argc);
+    if (!options.filesFrom.empty()) {
+        std::ifstream   listFile;
+        if (options.filesFrom != "-") {
+            listFile.open(options.filesFrom);
+            if (!listFile) {
+                std::cerr << "File: " << options.filesFrom << " could not be opened\n";
+                return 1;
+            }
+        }
+        std::istream&   list = options.filesFrom == "-" ? std::cin : listFile;
+        for (std::string line; std::getline(list, line);) {
+            if (!line.empty()) {
+                files.emplace_back(std::move(line));
+            }
+        }
+    }
+    else if (files.empty()) {
+        files.emplace_back("-");
+    }
+
+    if (files.size() == 1) {
+        return processFile(options, action[0], files[0], std::cerr);
+    }
+    return processFiles(options, action[0], files);
+}
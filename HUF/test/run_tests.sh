@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# Tests for huf (run from the HUF directory with: make test).
+# Each test prints a line starting with "ok" or "FAIL". The exit status is the number of failures.
+
+failures=0
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+pass()  { echo "ok   $1"; }
+fail()  { echo "FAIL $1"; failures=$((failures + 1)); }
+
+# The size of a file in bytes.
+fileSize() { stat -c %s "$1" 2>/dev/null || stat -f %z "$1"; }
+
+# Milliseconds since the epoch.
+now() { python3 -c 'import time; print(int(time.time() * 1000))'; }
+
+#
+# Streaming from a slow pipe:
+# Each block must be written before the next one is supplied (huf can not hold back finished blocks).
+#
+testSlowPipe()
+{
+    local block=65536
+    local out="$tmp/slow.huf"
+    exec 3> >(./huf --block=64K --threads=2 + > "$out")
+
+    local last=0
+    for n in 1 2 3 4; do
+        head -c $((block * n)) test/test.txt | tail -c $block >&3
+        local start=$(now)
+        while [ "$(fileSize "$out")" -le "$last" ]; do
+            if [ $(($(now) - start)) -gt 5000 ]; then
+                exec 3>&-
+                fail "slow pipe: block $n was not written before block $((n + 1)) was supplied"
+                return
+            fi
+            sleep 0.05
+        done
+        last=$(fileSize "$out")
+    done
+    exec 3>&-
+    wait
+
+    if ./huf - < "$out" | cmp -s - <(head -c $((block * 4)) test/test.txt); then
+        pass "slow pipe"
+    else
+        fail "slow pipe: the output does not decompress to the input"
+    fi
+}
+
+#
+# A full disk:
+# The output is written on a background thread but the failure must still be reported.
+#
+testFullDisk()
+{
+    if [ ! -w /dev/full ]; then
+        pass "full disk (skipped: no /dev/full)"
+        return
+    fi
+    for args in "" "--block=64K --threads=2"; do
+        if ./huf $args + - < test/test.txt > /dev/full 2> /dev/null; then
+            fail "full disk: huf $args succeeded writing to /dev/full"
+            return
+        fi
+    done
+    pass "full disk"
+}
+
+#
+# HuffmanInputStream (see stream_test.cpp).
+#
+testStream()
+{
+    ./test/stream_test test/test.txt
+    failures=$((failures + $?))
+}
+
+testSlowPipe
+testFullDisk
+testStream
+
+exit $failures
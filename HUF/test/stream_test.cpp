@@ -0,0 +1,176 @@
+#include "Huffman.h"
+#include "HuffmanStream.h"
+#include "HuffmanDictionary.h"
+#include "HuffmanStats.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iterator>
+#include <algorithm>
+#include <span>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+using ThorsAnvil::Puzzle::HuffmanEncoder;
+using ThorsAnvil::Puzzle::HuffmanDecoder;
+using ThorsAnvil::Puzzle::HuffmanInputStream;
+using ThorsAnvil::Puzzle::HuffmanDictionary;
+using ThorsAnvil::Puzzle::HuffmanStats;
+
+/*
+ * Tests for HuffmanInputStream, HuffmanDecoder::decompress(), HuffmanDictionary and HuffmanStats (run by test/run_tests.sh).
+ * Each test prints a line starting with "ok" or "FAIL". The exit status is the number of failures.
+ *
+ *  usage: stream_test <file>
+ */
+
+int failures = 0;
+
+void check(bool ok, std::string const& name)
+{
+    std::cout << (ok ? "ok   " : "FAIL ") << name << "\n";
+    failures += ok ? 0 : 1;
+}
+
+/*
+ * Compress input the way huf does for a file (the tree followed by the encoded data).
+ */
+std::string compress(std::string const& input, bool canonical)
+{
+    HuffmanEncoder      encoder(canonical);
+    std::ostringstream  out;
+    encoder.buildTree(std::span<char const>(input));
+    encoder.exportTree(out);
+    encoder.encode(std::span<char const>(input), out);
+    return out.str();
+}
+
+/*
+ * Decompress data with a HuffmanInputStream.
+ */
+std::string decompress(std::string const& data, bool& valid)
+{
+    std::istringstream  in(data);
+    HuffmanInputStream  huf(in);
+    std::string         output{std::istreambuf_iterator<char>(huf), std::istreambuf_iterator<char>()};
+    valid = huf.valid();
+    return output;
+}
+
+/*
+ * A file that is cut off before the EOF marker is not valid.
+ * The cuts are inside the last value of the bit stream, on a value boundary and in the middle.
+ */
+void testTruncated(std::string const& input, bool canonical)
+{
+    std::string         name        = canonical ? "canonical" : "legacy";
+    std::string         compressed  = compress(input, canonical);
+
+    bool                valid;
+    std::string         output      = decompress(compressed, valid);
+    check(valid && output == input, name + ": complete file");
+
+    for (std::size_t cut: {std::size_t{1}, std::size_t{7}, std::size_t{8}, std::size_t{9}, std::size_t{64}, compressed.size() / 2}) {
+        decompress(compressed.substr(0, compressed.size() - cut), valid);
+        check(!valid, name + ": truncated by " + std::to_string(cut) + " bytes");
+    }
+}
+
+/*
+ * A buffer from HuffmanEncoder::compress() that is cut off before the EOF marker is not valid.
+ */
+void testTruncatedBuffer(std::string const& input)
+{
+    std::span<std::byte const>  data(reinterpret_cast<std::byte const*>(input.data()), input.size());
+    HuffmanEncoder              encoder(true);
+    std::vector<std::byte>      compressed(encoder.maxCompressedSize(input.size()));
+    compressed.resize(encoder.compress(data, compressed));
+
+    HuffmanDecoder              decoder;
+    std::vector<std::byte>      output(input.size());
+    std::size_t                 size;
+    bool                        valid       = decoder.decompress(compressed, output, size);
+    check(valid && size == input.size() && std::equal(output.begin(), output.end(), data.begin()), "buffer: complete");
+
+    for (std::size_t cut: {std::size_t{1}, std::size_t{7}, std::size_t{8}, std::size_t{9}, std::size_t{1000}, compressed.size() / 2}) {
+        valid = decoder.decompress(std::span<std::byte const>(compressed).first(compressed.size() - cut), output, size);
+        check(!valid, "buffer: truncated by " + std::to_string(cut) + " bytes");
+    }
+}
+
+/*
+ * A decoder that used a dictionary must pick up the new code when the id is registered again.
+ */
+void testDictionaryReplaced(std::string const& input)
+{
+    std::span<std::byte const>  data(reinterpret_cast<std::byte const*>(input.data()), input.size());
+    HuffmanDecoder              decoder;
+    std::vector<std::byte>      output(input.size());
+    bool                        ok          = true;
+
+    HuffmanDictionary const*    first       = nullptr;
+    for (std::size_t skew = 0; skew < 2; ++skew) {
+        // The second dictionary gives different codes to the same bytes.
+        HuffmanEncoder::Histogram   counts{};
+        HuffmanEncoder::histogram(input, counts);
+        counts['e'] = skew == 0 ? counts['e'] : 1;
+        ok = ok && HuffmanDictionary::add(HuffmanDictionary::train(HuffmanDictionary::firstUserId + 1, counts));
+
+        HuffmanDictionary const*    dictionary  = HuffmanDictionary::find(HuffmanDictionary::firstUserId + 1);
+        first = first ? first : dictionary;
+        HuffmanEncoder              encoder;
+        encoder.useDictionary(*dictionary);
+        std::vector<std::byte>      compressed(encoder.maxCompressedSize(input.size()));
+        compressed.resize(encoder.compress(data, compressed));
+
+        std::size_t                 size;
+        ok = ok && decoder.decompress(compressed, output, size) && size == input.size() && std::equal(output.begin(), output.end(), data.begin());
+    }
+    // Registering more dictionaries does not move the existing ones.
+    for (std::uint32_t id = HuffmanDictionary::firstUserId + 2; id < HuffmanDictionary::firstUserId + 100; ++id) {
+        HuffmanDictionary::add(HuffmanDictionary::train(id, {}));
+    }
+    ok = ok && first == HuffmanDictionary::find(HuffmanDictionary::firstUserId + 1);
+    ok = ok && !HuffmanDictionary::add(HuffmanDictionary::train(HuffmanDictionary::textId, {}));
+    check(ok, "dictionary: registered again");
+}
+
+/*
+ * HuffmanStats::report() leaves the format of the stream as it was.
+ */
+void testStatsFormat()
+{
+    HuffmanStats        stats;
+    for (bool json: {false, true}) {
+        std::ostringstream  out;
+        out << std::scientific << std::setprecision(2) << std::setfill('*');
+        std::ios_base::fmtflags flags = out.flags();
+        stats.report(out, {"file", '+', 100, 50, 0.5}, json);
+        check(out.flags() == flags && out.precision() == 2 && out.fill() == '*', json ? "stats: json keeps the format" : "stats: text keeps the format");
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        std::cerr << "Usage: stream_test <file>\n";
+        return 1;
+    }
+    std::ifstream       file(argv[1], std::ios::binary);
+    std::string         input{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    if (input.empty()) {
+        std::cerr << "File: " << argv[1] << " could not be read\n";
+        return 1;
+    }
+
+    testTruncated(input, false);
+    testTruncated(input, true);
+    testTruncatedBuffer(input.substr(0, 10000));
+    testTruncatedBuffer(input);
+    testDictionaryReplaced(input.substr(0, 10000));
+    testStatsFormat();
+    return failures;
+}
@@ -1,7 +1,13 @@
+#include "HuffmanStream.h"
+
 #include <cctype>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <string_view>
+
+using ThorsAnvil::Puzzle::HuffmanInputStream;
 
 enum class Token {
     EndOfStream,
@@ -63,19 +69,40 @@ bool checkJson(std::string const& fileName, std::istream& file)
     return valid;
 }
 
+// Files compressed by huf are decompressed as they are parsed (--input-huf).
+bool checkJson(std::string const& fileName, std::istream& file, bool inputHuf)
+{
+    if (!inputHuf) {
+        return checkJson(fileName, file);
+    }
+    HuffmanInputStream  input(file);
+    bool valid      = checkJson(fileName, input);
+    if (!input.valid()) {
+        std::cerr << "Invalid huf file: " << fileName << "\n";
+        valid = false;
+    }
+    return valid;
+}
+
 int main(int argc, char* argv[])
 {
-    bool result = true;
-    if (argc == 1) {
-        result = checkJson("", std::cin);
+    bool result     = true;
+    bool inputHuf   = false;
+    int  first      = 1;
+    if (argc > 1 && std::string_view(argv[1]) == "--input-huf") {
+        inputHuf    = true;
+        first       = 2;
+    }
+    if (argc == first) {
+        result = checkJson("", std::cin, inputHuf);
     }
     else {
-        for (int loop = 1; loop < argc; ++loop) {
+        for (int loop = first; loop < argc; ++loop) {
             std::ifstream   file(argv[loop]);
             if (!file) {
                 std::cerr << "Invalid File: " << argv[loop] << "\n";
             }
-            if (!checkJson(argv[loop], file)) {
+            if (!checkJson(argv[loop], file, inputHuf)) {
                 result = false;
             }
         }
@@ -1,8 +1,12 @@
 #include "Lexer.h"
 #include "Parser.h"
+#include "HuffmanStream.h"
 
 #include <fstream>
 #include <iostream>
+#include <string_view>
+
+using ThorsAnvil::Puzzle::HuffmanInputStream;
 
 
 bool checkJson(std::istream& file, std::function<void(bool)>&& errorMsg)
@@ -22,21 +26,43 @@ void errorPrinter(bool valid, std::string const& fileName)
     }
 }
 
+// Files compressed by huf are decompressed as they are parsed (--input-huf).
+bool checkJson(std::istream& file, bool inputHuf, std::string const& fileName)
+{
+    auto printer = [&fileName](bool valid){errorPrinter(valid, fileName);};
+    if (!inputHuf) {
+        return checkJson(file, printer);
+    }
+    HuffmanInputStream  input(file);
+    bool valid = checkJson(input, printer);
+    if (!input.valid()) {
+        std::cerr << "Error: " << fileName << ":\t\tNot a valid huf file.\n";
+        valid = false;
+    }
+    return valid;
+}
+
 int main(int argc, char* argv[])
 {
-    bool result = true;
-    if (argc == 1) {
-        result = checkJson(std::cin, [](bool valid){errorPrinter(valid, "std::cin");});
+    bool result     = true;
+    bool inputHuf   = false;
+    int  first      = 1;
+    if (argc > 1 && std::string_view(argv[1]) == "--input-huf") {
+        inputHuf    = true;
+        first       = 2;
+    }
+    if (argc == first) {
+        result = checkJson(std::cin, inputHuf, "std::cin");
     }
     else {
-        for (int loop = 1; loop < argc; ++loop) {
+        for (int loop = first; loop < argc; ++loop) {
             std::ifstream   file(argv[loop]);
             if (!file) {
                 std::cerr << "Error: " << argv[loop] <<":\t\tCould not open file.\n";
                 result = false;
                 continue;
             }
-            if (!checkJson(file, [filename = argv[loop]](bool valid){errorPrinter(valid, filename);})) {
+            if (!checkJson(file, inputHuf, argv[loop])) {
                 result = false;
             }
         }
@@ -1,8 +1,34 @@
+#include "HuffmanIO.h"
+#include "HuffmanStream.h"
+
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <bit>
+#include <stdexcept>
+#include <exception>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <fstream>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <iostream>
+#include <iomanip>
+
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using ThorsAnvil::Puzzle::HuffmanInputStream;
+using ThorsAnvil::Puzzle::MappedFile;
 
 /*
  * Command line options.
@@ -15,6 +41,8 @@ struct Options
     bool    words       = false;
     bool    chars       = false;
     bool    bytes       = false;
+    bool    inputHuf    = false;
+    std::size_t threads = std::max(1U, std::thread::hardware_concurrency());
 };
 
 /*
@@ -68,85 +96,665 @@ static int unicodeSize[256] =             { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
                                             3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
                                             4, 4, 4, 4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0};
 
+/*
+ * White space does not depend on the locale.
+ * It is the Unicode white space std::iswspace() reports in a (glibc) UTF-8 locale:
+ *  '\t' to '\r', ' ' and the characters in categories Zs, Zl and Zp (except the no-break spaces U+00A0, U+2007 and U+202F).
+ */
+struct SpaceRange
+{
+    std::uint32_t   first;
+    std::uint32_t   last;
+};
+static constexpr SpaceRange spaceRanges[] = {{0x0009, 0x000D}, {0x0020, 0x0020}, {0x1680, 0x1680}, {0x2000, 0x2006},
+                                             {0x2008, 0x200A}, {0x2028, 0x2029}, {0x205F, 0x205F}, {0x3000, 0x3000}};
 
-Result getData(std::istream& file)
+/*
+ * Two level table built at compile time from spaceRanges.
+ *  page:   For each block of 256 code points the index of its bit map (block 0 has no white space).
+ *  bits:   The bit maps (one bit for each code point in the block).
+ */
+class SpaceTable
+{
+    static constexpr std::uint32_t  maxCodePoint    = 0x10FFFF;
+    static constexpr std::size_t    maxBlocks       = std::size(spaceRanges) + 1;
+
+    std::uint8_t    page[(maxCodePoint >> 8) + 1]   = {};
+    std::uint64_t   bits[maxBlocks][4]              = {};
+
+    public:
+        constexpr SpaceTable()
+        {
+            std::uint8_t    used = 1;
+            for (auto const& range: spaceRanges) {
+                for (std::uint32_t ch = range.first; ch <= range.last; ++ch) {
+                    if (page[ch >> 8] == 0) {
+                        page[ch >> 8] = used++;
+                    }
+                    bits[page[ch >> 8]][(ch >> 6) & 3] |= std::uint64_t{1} << (ch & 63);
+                }
+            }
+        }
+        constexpr bool operator()(std::uint32_t ch) const
+        {
+            return ch <= maxCodePoint && ((bits[page[ch >> 8]][(ch >> 6) & 3] >> (ch & 63)) & 1) != 0;
+        }
+};
+static constexpr SpaceTable isSpace;
+
+static_assert(isSpace(' ') && isSpace('\t') && isSpace('\r') && isSpace(0x3000) && isSpace(0x2028));
+static_assert(!isSpace('a') && !isSpace(0x00A0) && !isSpace(0x2007) && !isSpace(0x110020));
+
+/*
+ * The SIMD kernel looks at blockSize bytes at a time and describes them as bit masks (bit n is byte n).
+ *  newLine:        '\n'
+ *  space:          ASCII white space.
+ *  wideSpace:      The first byte of multi-byte white space (see spaceRanges). These are all 3 bytes:
+ *                  0xE1 0x9A 0x80, 0xE2 0x80 0x80-0x8A (not 0x87), 0xE2 0x80 0xA8-0xA9, 0xE2 0x81 0x9F and 0xE3 0x80 0x80.
+ *  continuation:   10xxxxxx (the second and later bytes of a multi-byte character).
+ *  lead2/3/4:      The first byte of a character of at least 2/3/4 bytes.
+ *  suspect:        Bytes the kernel can not count:
+ *                  Bytes that are not valid in UTF-8 (0xF8-0xFF).
+ *                  Over long encodings that may decode to white space:
+ *                  0xC0, 0xE0 followed by 0x80 and 0xF0 followed by 0x80-0x8F.
+ * Note: The kernels read two bytes past the end of the block.
+ */
+static constexpr int blockSize = 64;
+
+struct BlockMasks
+{
+    std::uint64_t   newLine;
+    std::uint64_t   space;
+    std::uint64_t   wideSpace;
+    std::uint64_t   continuation;
+    std::uint64_t   lead2;
+    std::uint64_t   lead3;
+    std::uint64_t   lead4;
+    std::uint64_t   suspect;
+};
+
+using BlockKernel = BlockMasks (*)(unsigned char const* block);
+
+/*
+ * Portable version (one byte at a time).
+ */
+BlockMasks blockMasksScalar(unsigned char const* block)
+{
+    BlockMasks  masks{};
+    for (int loop = 0; loop < blockSize; ++loop) {
+        unsigned char   c   = block[loop];
+        std::uint64_t   bit = std::uint64_t{1} << loop;
+        unsigned char   n1  = block[loop + 1];
+        unsigned char   n2  = block[loop + 2];
+        bool            tooLong     = c == 0xC0 || (c == 0xE0 && n1 == 0x80) || (c == 0xF0 && n1 <= 0x8F);
+        bool            wideSpace   = (c == 0xE1 && n1 == 0x9A && n2 == 0x80)
+                                   || (c == 0xE2 && n1 == 0x80 && ((n2 <= 0x8A && n2 != 0x87) || n2 == 0xA8 || n2 == 0xA9))
+                                   || (c == 0xE2 && n1 == 0x81 && n2 == 0x9F)
+                                   || (c == 0xE3 && n1 == 0x80 && n2 == 0x80);
+
+        masks.newLine       |= c == '\n'                   ? bit : 0;
+        masks.space         |= c == ' ' || (c >= '\t' && c <= '\r') ? bit : 0;
+        masks.continuation  |= (c & 0xC0) == 0x80          ? bit : 0;
+        masks.lead2         |= c >= 0xC0                   ? bit : 0;
+        masks.lead3         |= c >= 0xE0                   ? bit : 0;
+        masks.lead4         |= c >= 0xF0                   ? bit : 0;
+        masks.wideSpace     |= wideSpace                   ? bit : 0;
+        masks.suspect       |= c >= 0xF8 || tooLong        ? bit : 0;
+    }
+    return masks;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Unsigned byte compares are done with min/max (there is no unsigned compare instruction).
+ * (c - '\t') <= 4 (unsigned) is the range '\t' to '\r'.
+ */
+BlockMasks blockMasksSSE2(unsigned char const* block)
+{
+    __m128i const   newLine     = _mm_set1_epi8('\n');
+    __m128i const   blank       = _mm_set1_epi8(' ');
+    __m128i const   tab         = _mm_set1_epi8('\t');
+    __m128i const   four        = _mm_set1_epi8(4);
+    __m128i const   top2        = _mm_set1_epi8(static_cast<char>(0xC0));
+    __m128i const   x80         = _mm_set1_epi8(static_cast<char>(0x80));
+    __m128i const   xE0         = _mm_set1_epi8(static_cast<char>(0xE0));
+    __m128i const   xF0         = _mm_set1_epi8(static_cast<char>(0xF0));
+    __m128i const   xF8         = _mm_set1_epi8(static_cast<char>(0xF8));
+    __m128i const   x81         = _mm_set1_epi8(static_cast<char>(0x81));
+    __m128i const   x87         = _mm_set1_epi8(static_cast<char>(0x87));
+    __m128i const   x8A         = _mm_set1_epi8(static_cast<char>(0x8A));
+    __m128i const   x8F         = _mm_set1_epi8(static_cast<char>(0x8F));
+    __m128i const   x9A         = _mm_set1_epi8(static_cast<char>(0x9A));
+    __m128i const   x9F         = _mm_set1_epi8(static_cast<char>(0x9F));
+    __m128i const   xA8         = _mm_set1_epi8(static_cast<char>(0xA8));
+    __m128i const   xFE         = _mm_set1_epi8(static_cast<char>(0xFE));
+    __m128i const   xE1         = _mm_set1_epi8(static_cast<char>(0xE1));
+    __m128i const   xE2         = _mm_set1_epi8(static_cast<char>(0xE2));
+    __m128i const   xE3         = _mm_set1_epi8(static_cast<char>(0xE3));
+
+    BlockMasks  masks{};
+    for (int loop = 0; loop < blockSize; loop += 16) {
+        __m128i     v       = _mm_loadu_si128(reinterpret_cast<__m128i const*>(block + loop));
+        __m128i     fromTab = _mm_sub_epi8(v, tab);
+        __m128i     space   = _mm_or_si128(_mm_cmpeq_epi8(v, blank), _mm_cmpeq_epi8(_mm_min_epu8(fromTab, four), fromTab));
+
+        masks.newLine       |= std::uint64_t{static_cast<std::uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newLine)))} << loop;
+        masks.space         |= std::uint64_t{static_cast<std::uint16_t>(_mm_movemask_epi8(space))} << loop;
+        if (_mm_movemask_epi8(v) == 0) {
+            // All ASCII: there are no multi-byte characters (so the other masks are zero).
+            continue;
+        }
+
+        __m128i     next    = _mm_loadu_si128(reinterpret_cast<__m128i const*>(block + loop + 1));
+        __m128i     third   = _mm_loadu_si128(reinterpret_cast<__m128i const*>(block + loop + 2));
+        __m128i     lead2   = _mm_cmpeq_epi8(_mm_max_epu8(v, top2), v);
+        __m128i     lead3   = _mm_cmpeq_epi8(_mm_max_epu8(v, xE0), v);
+        __m128i     lead4   = _mm_cmpeq_epi8(_mm_max_epu8(v, xF0), v);
+        __m128i     next80  = _mm_cmpeq_epi8(next, x80);
+        __m128i     third80 = _mm_cmpeq_epi8(third, x80);
+        __m128i     tooLong = _mm_or_si128(_mm_cmpeq_epi8(v, top2), _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(v, xE0), next80), _mm_and_si128(_mm_cmpeq_epi8(v, xF0), _mm_cmpeq_epi8(_mm_min_epu8(next, x8F), next))));
+        __m128i     in2000  = _mm_or_si128(_mm_andnot_si128(_mm_cmpeq_epi8(third, x87), _mm_cmpeq_epi8(_mm_min_epu8(third, x8A), third)), _mm_cmpeq_epi8(_mm_and_si128(third, xFE), xA8));
+        __m128i     e1Space = _mm_and_si128(_mm_cmpeq_epi8(v, xE1), _mm_and_si128(_mm_cmpeq_epi8(next, x9A), third80));
+        __m128i     e2Space = _mm_and_si128(_mm_cmpeq_epi8(v, xE2), _mm_or_si128(_mm_and_si128(next80, in2000), _mm_and_si128(_mm_cmpeq_epi8(next, x81), _mm_cmpeq_epi8(third, x9F))));
+        __m128i     e3Space = _mm_and_si128(_mm_cmpeq_epi8(v, xE3), _mm_and_si128(next80, third80));
+        __m128i     wide    = _mm_or_si128(e1Space, _mm_or_si128(e2Space, e3Space));
+        __m128i     suspect = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, xF8), v), tooLong);
+
+        masks.wideSpace     |= std::uint64_t{static_cast<std::uint16_t>(_mm_movemask_epi8(wide))} << loop;
+        masks.continuation  |= std::uint64_t{static_cast<std::uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, top2), x80)))} << loop;
+        masks.lead2         |= std::uint64_t{static_cast<std::uint16_t>(_mm_movemask_epi8(lead2))} << loop;
+        masks.lead3         |= std::uint64_t{static_cast<std::uint16_t>(_mm_movemask_epi8(lead3))} << loop;
+        masks.lead4         |= std::uint64_t{static_cast<std::uint16_t>(_mm_movemask_epi8(lead4))} << loop;
+        masks.suspect       |= std::uint64_t{static_cast<std::uint16_t>(_mm_movemask_epi8(suspect))} << loop;
+    }
+    return masks;
+}
+
+__attribute__((target("avx2")))
+BlockMasks blockMasksAVX2(unsigned char const* block)
+{
+    __m256i const   newLine     = _mm256_set1_epi8('\n');
+    __m256i const   blank       = _mm256_set1_epi8(' ');
+    __m256i const   tab         = _mm256_set1_epi8('\t');
+    __m256i const   four        = _mm256_set1_epi8(4);
+    __m256i const   top2        = _mm256_set1_epi8(static_cast<char>(0xC0));
+    __m256i const   x80         = _mm256_set1_epi8(static_cast<char>(0x80));
+    __m256i const   xE0         = _mm256_set1_epi8(static_cast<char>(0xE0));
+    __m256i const   xF0         = _mm256_set1_epi8(static_cast<char>(0xF0));
+    __m256i const   xF8         = _mm256_set1_epi8(static_cast<char>(0xF8));
+    __m256i const   x81         = _mm256_set1_epi8(static_cast<char>(0x81));
+    __m256i const   x87         = _mm256_set1_epi8(static_cast<char>(0x87));
+    __m256i const   x8A         = _mm256_set1_epi8(static_cast<char>(0x8A));
+    __m256i const   x8F         = _mm256_set1_epi8(static_cast<char>(0x8F));
+    __m256i const   x9A         = _mm256_set1_epi8(static_cast<char>(0x9A));
+    __m256i const   x9F         = _mm256_set1_epi8(static_cast<char>(0x9F));
+    __m256i const   xA8         = _mm256_set1_epi8(static_cast<char>(0xA8));
+    __m256i const   xFE         = _mm256_set1_epi8(static_cast<char>(0xFE));
+    __m256i const   xE1         = _mm256_set1_epi8(static_cast<char>(0xE1));
+    __m256i const   xE2         = _mm256_set1_epi8(static_cast<char>(0xE2));
+    __m256i const   xE3         = _mm256_set1_epi8(static_cast<char>(0xE3));
+
+    BlockMasks  masks{};
+    for (int loop = 0; loop < blockSize; loop += 32) {
+        __m256i     v       = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(block + loop));
+        __m256i     fromTab = _mm256_sub_epi8(v, tab);
+        __m256i     space   = _mm256_or_si256(_mm256_cmpeq_epi8(v, blank), _mm256_cmpeq_epi8(_mm256_min_epu8(fromTab, four), fromTab));
+
+        masks.newLine       |= std::uint64_t{static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newLine)))} << loop;
+        masks.space         |= std::uint64_t{static_cast<std::uint32_t>(_mm256_movemask_epi8(space))} << loop;
+        if (_mm256_movemask_epi8(v) == 0) {
+            // All ASCII: there are no multi-byte characters (so the other masks are zero).
+            continue;
+        }
+
+        __m256i     next    = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(block + loop + 1));
+        __m256i     third   = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(block + loop + 2));
+        __m256i     lead2   = _mm256_cmpeq_epi8(_mm256_max_epu8(v, top2), v);
+        __m256i     lead3   = _mm256_cmpeq_epi8(_mm256_max_epu8(v, xE0), v);
+        __m256i     lead4   = _mm256_cmpeq_epi8(_mm256_max_epu8(v, xF0), v);
+        __m256i     next80  = _mm256_cmpeq_epi8(next, x80);
+        __m256i     third80 = _mm256_cmpeq_epi8(third, x80);
+        __m256i     tooLong = _mm256_or_si256(_mm256_cmpeq_epi8(v, top2), _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v, xE0), next80), _mm256_and_si256(_mm256_cmpeq_epi8(v, xF0), _mm256_cmpeq_epi8(_mm256_min_epu8(next, x8F), next))));
+        __m256i     in2000  = _mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(third, x87), _mm256_cmpeq_epi8(_mm256_min_epu8(third, x8A), third)), _mm256_cmpeq_epi8(_mm256_and_si256(third, xFE), xA8));
+        __m256i     e1Space = _mm256_and_si256(_mm256_cmpeq_epi8(v, xE1), _mm256_and_si256(_mm256_cmpeq_epi8(next, x9A), third80));
+        __m256i     e2Space = _mm256_and_si256(_mm256_cmpeq_epi8(v, xE2), _mm256_or_si256(_mm256_and_si256(next80, in2000), _mm256_and_si256(_mm256_cmpeq_epi8(next, x81), _mm256_cmpeq_epi8(third, x9F))));
+        __m256i     e3Space = _mm256_and_si256(_mm256_cmpeq_epi8(v, xE3), _mm256_and_si256(next80, third80));
+        __m256i     wide    = _mm256_or_si256(e1Space, _mm256_or_si256(e2Space, e3Space));
+        __m256i     suspect = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, xF8), v), tooLong);
+
+        masks.wideSpace     |= std::uint64_t{static_cast<std::uint32_t>(_mm256_movemask_epi8(wide))} << loop;
+        masks.continuation  |= std::uint64_t{static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, top2), x80)))} << loop;
+        masks.lead2         |= std::uint64_t{static_cast<std::uint32_t>(_mm256_movemask_epi8(lead2))} << loop;
+        masks.lead3         |= std::uint64_t{static_cast<std::uint32_t>(_mm256_movemask_epi8(lead3))} << loop;
+        masks.lead4         |= std::uint64_t{static_cast<std::uint32_t>(_mm256_movemask_epi8(lead4))} << loop;
+        masks.suspect       |= std::uint64_t{static_cast<std::uint32_t>(_mm256_movemask_epi8(suspect))} << loop;
+    }
+    return masks;
+}
+#endif
+
+/*
+ * Pick the best kernel the processor supports.
+ */
+BlockKernel blockKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        return blockMasksAVX2;
+    }
+    return blockMasksSSE2;
+#else
+    return blockMasksScalar;
+#endif
+}
+
+/*
+ * The state carried from one character to the next.
+ */
+struct Counter
 {
     Result      result;
     bool        inWord = false;
 
-    // We will read chunks of 'bufferSize' from the stream.
-    // But if we hit a multi-byte character as the last character in the buffer we will read that
-    // into the buffer so we need a capacity 'bufferCapacity' that is slightly larger in case we
-    // need it.
-    static constexpr int bufferSize = 4096;
-    static constexpr int bufferCapacity = bufferSize + 3;
+    /*
+     * Count the character that starts at buffer[loop].
+     * Returns the number of bytes in the character.
+     */
+    int countChar(unsigned char const* buffer, int loop)
+    {
+        unsigned int index = buffer[loop];
+        int increment = unicodeSize[index];
 
-    unsigned char buffer[bufferCapacity];
+        // Assumption that we only care about UTF-8 stream and not other
+        // multi-byte character systems. And yes that is true. I don't care.
+        // One standard to cover them all stop using other multi-byte systems.
+        // Rant over.
+        std::uint32_t  ch = 0;
+        switch (increment) {
+            case 0:     throw std::runtime_error("Bad Input");
+            case 1:     ch = index;break;
+            case 2:     ch = ((static_cast<int>(buffer[loop + 0]) & 0x1F) <<  6)
+                           | ((static_cast<int>(buffer[loop + 1]) & 0x3F) <<  0);
+                        break;
+            case 3:     ch = ((static_cast<int>(buffer[loop + 0]) & 0x0F) << 12)
+                           | ((static_cast<int>(buffer[loop + 1]) & 0x3F) <<  6)
+                           | ((static_cast<int>(buffer[loop + 2]) & 0x3F) <<  0);
+                        break;
+            case 4:     ch = ((static_cast<int>(buffer[loop + 0]) & 0x07) << 18)
+                           | ((static_cast<int>(buffer[loop + 1]) & 0x3F) << 12)
+                           | ((static_cast<int>(buffer[loop + 2]) & 0x3F) <<  6)
+                           | ((static_cast<int>(buffer[loop + 3]) & 0x3F) <<  0);
+                        break;
+        }
 
-    file.read(reinterpret_cast<char*>(buffer), bufferSize);
-    std::streamsize count = file.gcount();
-    while (count != 0) {
+        // Count the number of new line characters.
+        result.lines += newLineCheck[index];
 
-        int increment;
-        for (auto loop = 0; loop < count; loop += increment) {
+        // Words are "white space" separated.
+        // Increment the counter when we are not in a word and hit one.
+        // We are not in a word when there is white space.
+        bool space = isSpace(ch);
+        result.words += (!inWord && !space) ? 1 : 0;
 
-            unsigned int index = buffer[loop];
+        // Keep track if we are in the word.
+        inWord = !space;
 
-            increment = unicodeSize[index];
-            if (loop + increment > count) {
-                // If the last character extends beyond the buffer then read it into
-                // the buffer. We have made sure the buffer capacity is enough to hold
-                // these extra characters.
-                int read = loop + increment - count;
-                file.read(reinterpret_cast<char*>(&buffer[count]), read);
-                count += read;
-            }
+        // We are parsing one character at a time in this loop.
+        result.chars += 1;
 
-            // Assumption that we only care about UTF-8 stream and not other
-            // multi-byte character systems. And yes that is true. I don't care.
-            // One standard to cover them all stop using other multi-byte systems.
-            // Rant over.
-            std::wint_t  ch;
-            switch (increment) {
-                case 0:     throw std::runtime_error("Bad Input");
-                case 1:     ch = index;break;
-                case 2:     ch = ((static_cast<int>(buffer[loop + 0]) & 0x1F) <<  6)
-                               | ((static_cast<int>(buffer[loop + 1]) & 0x3F) <<  0);
-                            break;
-                case 3:     ch = ((static_cast<int>(buffer[loop + 0]) & 0x0F) << 12)
-                               | ((static_cast<int>(buffer[loop + 1]) & 0x3F) <<  6)
-                               | ((static_cast<int>(buffer[loop + 2]) & 0x3F) <<  0);
-                            break;
-                case 4:     ch = ((static_cast<int>(buffer[loop + 0]) & 0x07) << 18)
-                               | ((static_cast<int>(buffer[loop + 1]) & 0x3F) << 12)
-                               | ((static_cast<int>(buffer[loop + 2]) & 0x3F) <<  6)
-                               | ((static_cast<int>(buffer[loop + 3]) & 0x3F) <<  0);
-                            break;
-            }
+        // The character may be multiple bytes.
+        result.bytes += increment;
+        return increment;
+    }
 
-            // Count the number of new line characters.
-            result.lines += newLineCheck[index];
+    /*
+     * Count a block of blockSize bytes from its masks (see BlockMasks).
+     * The block starts on a character boundary.
+     * Returns the number of bytes used (the block plus the rest of a character that starts in the block)
+     * or zero if the block has to be counted one character at a time.
+     */
+    int countBlock(BlockMasks const& masks);
+};
 
-            // Words are "white space" separated.
-            // Increment the counter when we are not in a word and hit one.
-            // We are not in a word when there is white space.
-            bool isSpace = std::iswspace(ch);
-            result.words += (!inWord && !isSpace) ? 1 : 0;
+/*
+ * A block can be counted from its masks if every lead byte is followed by the right number
+ * of continuation bytes (and there are no others) and there are no suspect bytes.
+ * Then (like the character loop):
+ *  lines:  Every '\n' (it can not be part of a multi-byte character).
+ *  chars:  Every byte that is not a continuation byte.
+ *  words:  Non space bytes that follow a space.
+ *          All the bytes of multi-byte white space are treated as space so continuation bytes never start a word
+ *          (they follow the first byte of their character and have the same class).
+ *          White space at the end of the block is carried to the next block in inWord.
+ * The last character can run up to 3 bytes past the end of the block (these are not checked, like the
+ * character loop which takes the bytes without looking at them).
+ */
+int Counter::countBlock(BlockMasks const& masks)
+{
+    std::uint64_t   expected    = (masks.lead2 << 1) | (masks.lead3 << 2) | (masks.lead4 << 3);
+    std::uint64_t   overflow    = (masks.lead2 >> 63) | (masks.lead3 >> 62) | (masks.lead4 >> 61);
+    if (expected != masks.continuation || masks.suspect != 0) {
+        return 0;
+    }
+
+    int             extra       = std::bit_width(overflow);
+    std::uint64_t   space       = masks.space | masks.wideSpace | (masks.wideSpace << 1) | (masks.wideSpace << 2);
+    std::uint64_t   wordStart   = ~space & ((space << 1) | (inWord ? 0 : 1));
+
+    result.lines    += std::popcount(masks.newLine);
+    result.words    += std::popcount(wordStart);
+    result.chars    += blockSize - std::popcount(masks.continuation);
+    result.bytes    += blockSize + extra;
+    inWord          = (space >> 63) == 0;
+    return blockSize + extra;
+}
+
+/*
+ * Count the characters in [loop, end) one at a time.
+ * The last character may extend past end.
+ * Returns the position after the last character.
+ */
+int countChars(Counter& counter, unsigned char const* buffer, int loop, int end)
+{
+    while (loop < end) {
+        loop += counter.countChar(buffer, loop);
+    }
+    return loop;
+}
 
-            // Keep track if we are in the word.
-            inWord = !isSpace;
+/*
+ * Count the characters that start in [0, end) of a span of memory.
+ * The bytes in [end, size) are only used to finish the last character.
+ * Returns the position after the last character that was counted.
+ * A character that does not fit in the span is not counted (this leaves at most 3 bytes):
+ * the caller carries it to the next span or (at the end of the input) uses countLast().
+ */
+std::size_t countSpan(Counter& counter, unsigned char const* data, std::size_t end, std::size_t size)
+{
+    static BlockKernel const kernel = blockKernel();
 
-            // We are parsing one character at a time in this loop.
-            result.chars += 1;
+    // Whole blocks are counted with the SIMD kernel.
+    // A block needs 3 bytes after it (to see the end of a character that starts in the block).
+    std::size_t loop = 0;
+    while (loop + blockSize <= end && loop + blockSize + 3 <= size) {
+        int used = counter.countBlock(kernel(data + loop));
+        loop += used != 0 ? used : countChars(counter, data, loop, loop + blockSize) - loop;
+    }
+    while (loop < end && loop + unicodeSize[data[loop]] <= size) {
+        loop += counter.countChar(data, loop);
+    }
+    return loop;
+}
+
+/*
+ * Count a character that is cut short by the end of the input.
+ * It is counted as a whole character (the missing bytes are treated as zero).
+ */
+int countLast(Counter& counter, unsigned char const* data, std::size_t size)
+{
+    unsigned char   last[4] = {};
+    std::copy(data, data + std::min<std::size_t>(size, 4), last);
+    return counter.countChar(last, 0);
+}
 
-            // The character may be multiple bytes.
-            result.bytes += increment;
+/*
+ * Count a stream (a pipe, the standard input or a file being decompressed).
+ * The stream is read in large chunks.
+ * A character that runs off the end of a chunk (at most 3 bytes) is carried to the front of the next one.
+ */
+Result getData(std::istream& file)
+{
+    static constexpr std::size_t bufferSize     = 1024 * 1024;
+    static constexpr std::size_t bufferAlign    = 4096;
+
+    struct Free {void operator()(unsigned char* buffer) const {::operator delete[](buffer, std::align_val_t{bufferAlign});}};
+    std::unique_ptr<unsigned char[], Free>  buffer(static_cast<unsigned char*>(::operator new[](bufferSize + bufferAlign, std::align_val_t{bufferAlign})));
+
+    // The carry is kept just before the aligned part of the buffer (reads go to an aligned address).
+    unsigned char*  chunk = buffer.get() + bufferAlign;
+    std::size_t     carry = 0;
+    Counter         counter;
+    while (file.read(reinterpret_cast<char*>(chunk), bufferSize) || file.gcount() != 0) {
+        unsigned char*  start   = chunk - carry;
+        std::size_t     size    = carry + file.gcount();
+        std::size_t     used    = countSpan(counter, start, size, size);
+        carry = size - used;
+        std::copy(start + used, start + size, chunk - carry);
+    }
+    if (carry != 0) {
+        countLast(counter, chunk - carry, carry);
+    }
+    return counter.result;
+}
+
+/*
+ * The count of a range of a file (see getParallelData()).
+ * Along with the counts it records where the range starts and ends (the end is after the last
+ * character that starts in the range) and the white space state at each end.
+ * Like Result they are added together (in order) to give the count for the file:
+ * a word that runs across the boundary is only counted once.
+ */
+struct Partial
+{
+    Result              result;
+    std::uint64_t       begin           = 0;
+    std::uint64_t       end             = 0;
+    bool                empty           = true;
+    bool                startsInWord    = false;    // The first character is not white space.
+    bool                endsInWord      = false;    // The last character is not white space.
+    std::exception_ptr  error;
+
+    void operator+=(Partial const& rhs) {
+        if (rhs.empty) {
+            return;
+        }
+        result += rhs.result;
+        if (!empty && endsInWord && rhs.startsInWord) {
+            result.words -= 1;
+        }
+        if (empty) {
+            begin           = rhs.begin;
+            startsInWord    = rhs.startsInWord;
+        }
+        end         = rhs.end;
+        endsInWord  = rhs.endsInWord;
+        empty       = false;
+    }
+};
+
+/*
+ * Count the characters that start in [begin, end) of a mapped file.
+ * When align is true the range starts at the first byte that is not a continuation byte
+ * (the ones before it are the end of a character in the previous range).
+ */
+Partial countRange(MappedFile const& file, std::uint64_t begin, std::uint64_t end, bool align)
+{
+    unsigned char const*    data = reinterpret_cast<unsigned char const*>(file.span().data());
+    std::uint64_t           size = file.span().size();
+
+    Partial         part;
+    try {
+        for (int skip = 0; align && skip < 3 && begin < end && (data[begin] & 0xC0) == 0x80; ++skip) {
+            ++begin;
+        }
+        part.begin  = begin;
+        part.end    = begin;
+        if (begin >= end) {
+            return part;
+        }
+
+        // Look at the first character (it tells us if the range starts in a word).
+        Counter         first;
+        if (countSpan(first, data + begin, 1, size - begin) == 0) {
+            countLast(first, data + begin, size - begin);
+        }
+
+        Counter         counter;
+        std::uint64_t   used = countSpan(counter, data + begin, end - begin, size - begin);
+        if (begin + used < end) {
+            used += countLast(counter, data + begin + used, size - begin - used);
+        }
+        part.result         = counter.result;
+        part.end            = begin + used;
+        part.empty          = false;
+        part.startsInWord   = first.inWord;
+        part.endsInWord     = counter.inWord;
+    }
+    catch (...) {
+        part.error = std::current_exception();
+    }
+    return part;
+}
+
+/*
+ * Count a mapped file.
+ * A large file is split into ranges that are counted at the same time.
+ * The ranges start on a character boundary (see countRange()) and the partial counts are added in order.
+ * If a range does not start where the previous one ended (this only happens if the file is not
+ * valid UTF-8) it is counted again from the right place so the result is the same as counting
+ * the file in one go (including where a "Bad Input" error is found).
+ */
+Result getMappedData(MappedFile const& file, std::size_t ranges)
+{
+    std::uint64_t               size = file.span().size();
+    std::vector<std::uint64_t>  bounds;
+    for (std::size_t loop = 0; loop <= ranges; ++loop) {
+        bounds.emplace_back(size / ranges * loop);
+    }
+    bounds.back() = size;
+
+    std::vector<Partial>        parts(ranges);
+    std::vector<std::thread>    workers;
+    for (std::size_t loop = 1; loop < ranges; ++loop) {
+        workers.emplace_back([&, loop](){parts[loop] = countRange(file, bounds[loop], bounds[loop + 1], true);});
+    }
+    parts[0] = countRange(file, bounds[0], bounds[1], false);
+    for (auto& worker: workers) {
+        worker.join();
+    }
+
+    Partial     total;
+    for (std::size_t loop = 0; loop < ranges; ++loop) {
+        if (parts[loop].begin != total.end) {
+            parts[loop] = countRange(file, total.end, bounds[loop + 1], false);
+        }
+        if (parts[loop].error) {
+            std::rethrow_exception(parts[loop].error);
+        }
+        total += parts[loop];
+    }
+    return total.result;
+}
+
+/*
+ * Files compressed by huf are decompressed as they are read (--input-huf).
+ * Returns false if the file is not a valid huf file.
+ */
+bool getFileData(std::istream& file, Options const& options, Result& result)
+{
+    if (!options.inputHuf) {
+        result = getData(file);
+        return true;
+    }
+    HuffmanInputStream  input(file);
+    result = getData(input);
+    return input.valid();
+}
+
+/*
+ * A regular file is mapped into memory and counted in place.
+ * If it is large enough it is counted by several threads (see getMappedData()).
+ * Each thread counts at least minRangeSize bytes.
+ * Returns false if the file can not be mapped (it is read as a stream).
+ */
+static constexpr std::uint64_t minRangeSize = 16 * 1024 * 1024;
+
+bool getMappedData(std::string const& fileName, Options const& options, Result& result)
+{
+    MappedFile      mapped(fileName);
+    if (!mapped.isOpen()) {
+        return false;
+    }
+    std::size_t     ranges = std::min<std::uint64_t>(options.threads, mapped.span().size() / minRangeSize);
+    result = getMappedData(mapped, std::max<std::size_t>(ranges, 1));
+    return true;
+}
+
+/*
+ * The result of counting one of the files on the command line.
+ */
+struct FileData
+{
+    bool                opened  = false;
+    bool                valid   = true;     // false if the file is not a valid huf file (--input-huf).
+    Result              result;
+    std::exception_ptr  error;
+};
+
+FileData countFile(std::string const& fileName, Options const& options)
+{
+    FileData    data;
+    try {
+        // The stream is only opened if the file can not be mapped (so a worker only has one file open).
+        if (!options.inputHuf && getMappedData(fileName, options, data.result)) {
+            data.opened = true;
+            return data;
+        }
+        std::ifstream   file(fileName);
+        if (file) {
+            data.opened = true;
+            data.valid  = getFileData(file, options, data.result);
         }
-        file.read(reinterpret_cast<char*>(buffer), bufferSize);
-        count = file.gcount();
     }
+    catch (...) {
+        data.error = std::current_exception();
+    }
+    return data;
+}
+
+/*
+ * Count files concurrently (so the time waiting for one file to be read is used to count another).
+ * No more than maxOpenFiles files are open at the same time (one for each worker).
+ * The threads for a large file (--threads) are shared between the workers.
+ * The results are passed to 'action' in the order of the files (each one as soon as it and all
+ * the files before it are done).
+ */
+static constexpr std::size_t maxOpenFiles = 16;
 
-    return result;
+template<typename Action>
+void countFiles(std::vector<std::string> const& files, Options const& options, Action&& action)
+{
+    std::size_t                 workerCount = std::min(files.size(), maxOpenFiles);
+    Options                     fileOptions = options;
+    fileOptions.threads = std::max<std::size_t>(1, options.threads / std::max<std::size_t>(1, workerCount));
+
+    std::vector<FileData>       data(files.size());
+    std::vector<char>           done(files.size(), false);
+    std::mutex                  mutex;
+    std::condition_variable     finished;
+    std::atomic<std::size_t>    next = 0;
+
+    std::vector<std::jthread>   workers;
+    for (std::size_t loop = 0; loop < workerCount; ++loop) {
+        workers.emplace_back([&]()
+        {
+            for (std::size_t index = next++; index < files.size(); index = next++) {
+                FileData    result = countFile(files[index], fileOptions);
+
+                std::unique_lock    lock(mutex);
+                data[index] = std::move(result);
+                done[index] = true;
+                finished.notify_all();
+            }
+        });
+    }
+    for (std::size_t loop = 0; loop < files.size(); ++loop) {
+        {
+            std::unique_lock    lock(mutex);
+            finished.wait(lock, [&](){return done[loop];});
+        }
+        action(files[loop], data[loop]);
+    }
 }
 
 void display(std::string const& fileName, Options const& options, Result const& data)
@@ -179,6 +787,20 @@ int main(int argc, char* argv[])
         if (argv[loop][0] != '-') {
             break;
         }
+        if (std::string_view(argv[loop]) == "--input-huf") {
+            options.inputHuf = true;
+            continue;
+        }
+        if (std::string_view(argv[loop]).starts_with("--threads=")) {
+            std::string_view    value(argv[loop] + 10);
+            auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), options.threads);
+            if (ec != std::errc{} || end != value.data() + value.size()) {
+                std::cerr << "Usage: wc [-lwmc] [--input-huf] [--threads=<count>] <files>*\n";
+                return 1;
+            }
+            options.threads = std::max<std::size_t>(1, options.threads);
+            continue;
+        }
 
         /* Allow old style unix flags */
         for (int flag = 1; argv[loop][flag]; ++flag) {
@@ -188,7 +810,7 @@ int main(int argc, char* argv[])
                 case 'm': options.any = false; options.chars = true; break;
                 case 'c': options.any = false; options.bytes = true; break;
                 default:
-                    std::cerr << "Usage: wc [-lwmc] <files>*\n";
+                    std::cerr << "Usage: wc [-lwmc] [--input-huf] [--threads=<count>] <files>*\n";
                     return 1;
             }
         }
@@ -201,23 +823,30 @@ int main(int argc, char* argv[])
 
     /* If no files are explicitly set then use std::cin */
     if (files.size() == 0) {
-        Result data = getData(std::cin);
+        Result data;
+        if (!getFileData(std::cin, options, data)) {
+            std::cerr << "Invalid huf file: std::cin\n";
+        }
         display("", options, data);
     }
-    /* Loop over all the specified files */
+    /* Count all the specified files (several at a time) and display them in order */
     Result total;
-    for (auto fileName: files) {
-        std::ifstream   file(fileName);
-        if (!file) {
+    countFiles(files, options, [&](std::string const& fileName, FileData const& data)
+    {
+        if (data.error) {
+            std::rethrow_exception(data.error);
+        }
+        if (!data.opened) {
             std::cerr << "Failure to open file: " << fileName << "\n";
+            return;
         }
-        else {
-            Result data = getData(file);
-            display(fileName, options, data);
-
-            total += data;
+        if (!data.valid) {
+            std::cerr << "Invalid huf file: " << fileName << "\n";
         }
-    }
+        display(fileName, options, data.result);
+
+        total += data.result;
+    });
     if (files.size() > 1) {
         display("total", options, total);
     }